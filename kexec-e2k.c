@@ -7,30 +7,107 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <glob.h>
+#include <fnmatch.h>
+#include <elf.h>
 #include <utmp.h>
 #include <utmpx.h>
 #include <unistd.h>
 #include <limits.h>
+#include <setjmp.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <sys/syscall.h>
 #include <sys/sysmacros.h>
 #include <sys/mount.h>
 #include <sys/klog.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
 #include <linux/fb.h>
+#include <linux/netlink.h>
+#ifndef NO_IO_URING
+#include <linux/io_uring.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
 
 typedef uint64_t u64;
+#ifdef NO_ASM_KEXEC
+/* Stand-in for e2k <asm/kexec.h>, so that the tool builds on other hosts and may be run against a fake kexec device */
+struct kexec_reboot_param
+{
+    char *cmdline;
+    int cmdline_size;
+    void *image;
+    u64 image_size;
+    void *initrd;
+    u64 initrd_size;
+};
+
+struct lintel_reboot_param
+{
+    void *image;
+    u64 image_size;
+};
+
+#define KEXEC_REBOOT  _IOR('k', 0, struct kexec_reboot_param)
+#define LINTEL_REBOOT _IOR('k', 1, struct lintel_reboot_param)
+#else
 #include <asm/kexec.h>
+#endif
 
-const size_t alignment = 4096;
+#define ALIGNMENT 4096
+const size_t alignment = ALIGNMENT;
 
 const uint64_t LINTEL_BCD_SIGNATURE = 0x012345678ABCDEF0ull;
 
-struct lintel_reboot_param lintel __attribute__((aligned(alignment)));
-struct kexec_reboot_param kernel __attribute__((aligned(alignment)));
+struct lintel_reboot_param lintel __attribute__((aligned(ALIGNMENT)));
+struct kexec_reboot_param kernel __attribute__((aligned(ALIGNMENT)));
 char kcmdline[COMMAND_LINE_SIZE];
 
+/* Where sysfs, procfs and devtmpfs are looked for; may be relocated to run against a fixture tree */
+const char *sys_root = "/sys";
+const char *proc_root = "/proc";
+const char *dev_root = "/dev";
+
+/* How image buffers are allocated: images of huge_threshold bytes or more go to huge pages, and everything is locked in memory until reboot */
+size_t huge_threshold = 64 << 20;
+int use_hugepages = 1;
+int lock_images = 1;
+
+/* Image files are read with up to io_depth io_uring requests in flight; 0 or 1 means plain pread() */
+int io_depth = 16;
+#define MAX_IO_DEPTH 4096
+
+#if !defined(NO_IO_URING) && defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define USE_IO_URING
+#endif
+
+#ifndef MLOCK_ONFAULT
+#define MLOCK_ONFAULT 0x01
+#endif
+
+#ifndef FIFREEZE
+#define FIFREEZE _IOWR('X', 119, int)
+#endif
+#ifndef FITHAW
+#define FITHAW _IOWR('X', 120, int)
+#endif
+
 struct __attribute__((packed)) xrt_BcdHeader_t
 {
     uint64_t signature;
@@ -47,6 +124,8 @@ struct __attribute__((packed)) xrt_BcdFile_t
     uint32_t checksum;
 };
 
+#define MAX_BCD_FILES 65536 /* sanity limit for number of files in BCD table */
+
 enum xrt_BcdFileTag_t
 {
     PRIORITY_TAG_LINTEL,
@@ -90,6 +169,7 @@ enum cancel_reasons_t
     C_BCD_READ,
     C_BCD_NOTFOUND,
     C_BCD_SEEK,
+    C_BCD_DEVICE,
     C_OPTARG = 40,
     C_OPTARG_LONG,
     C_OPTARG_WRONG_TTY,
@@ -104,6 +184,8 @@ enum cancel_reasons_t
     C_LINUX_CMDLINE_LONG,
     C_LINUX_RESCMDLINE_LONG,
     C_LINUX_OPEN_INITRD,
+    C_LINUX_INITRD_MANY,
+    C_LINUX_READ_INITRD,
     C_FBDEV_OPEN = 60,
     C_FBDEV_IOCTL,
     C_FBDEV_CLOSE,
@@ -152,9 +234,53 @@ enum cancel_reasons_t
     C_XGLOB_ALLOC = 123,
     C_XGLOB_ABORT,
     C_XGLOB_NONE,
-    C_XGLOB_UNEXPECTED
+    C_XGLOB_UNEXPECTED,
+    C_XSCAN_OPEN,
+    C_REMOUNT_TIMEOUT = 130,
+    C_REMOUNT_KMSG,
+    C_OPTARG_WRONG_TIMEOUT,
+    C_MOUNTINFO_OPEN = 135,
+    C_MOUNTINFO_ALLOC,
+    C_MOUNTINFO_PARSE,
+    C_FLUSH_THREAD,
+    C_DEV_FAKE = 139,
+    C_DEV_FAKE_WRITE,
+    C_DECOMP_UNSUPPORTED = 141,
+    C_DECOMP_INPUT,
+    C_DECOMP_ALLOC,
+    C_DECOMP_DATA,
+    C_BCD_LAYOUT = 145,
+    C_INSPECT = 146,
+    C_EXTRACT_TAG,
+    C_EXTRACT_WRITE,
+    C_OPTARG_EXTRACT,
+    C_OPTARG_WRONG_THRESHOLD,
+    C_AUTO_SCAN = 151,
+    C_AUTO_NONE,
+    C_AUTO_AMBIG,
+    C_SCAN_MAP = 154,
+    C_OPTARG_WRONG_DEPTH = 155,
+    C_DAEMON_SOCKET = 156,
+    C_DAEMON_STALE,
+    C_DAEMON_STDIN,
+    C_OPTARG_WRONG_RUNS = 159,
+    C_BENCH_FILE,
+    C_BENCH_ALLOC,
+    C_BENCH_THREAD,
+    C_OPTARG_WRONG_REMOUNT = 163,
+    C_REMOUNT_THREAD,
+    C_REMOUNT_ALLOC
 };
 
+#define LIST_TABLE 1
+#define LIST_JSON 2
+#define REMOUNT_SYSRQ 0
+#define REMOUNT_TARGETED 1
+#define MAX_EXTRACTS 16
+#define MAX_INITRDS 16
+#define DAEMON_CLIENT_TIMEOUT 5000 /* ms to wait for a command from a connected client */
+#define MAX_BENCH_RUNS 100000
+
 struct flags_t
 {
     int mounts;
@@ -177,8 +303,27 @@ struct flags_t
     int ethnum;     /* no effect if defethnum != 0 */
     int defethtype;
     int ethtype;    /* no effect if defethtype != 0 */
+    int mmap;
+    int remount_timeout; /* seconds, 0 to wait forever */
+    const char *report;  /* NULL if not requested */
+    const char *xservers;
+    int bgload;
+    const char *cache;   /* staging cache directory, NULL if not used */
+    int decompress;
+    int list;            /* 0 to boot, or list BCD contents as LIST_TABLE or LIST_JSON */
+    int extract_num;
+    const char *extract[MAX_EXTRACTS]; /* TAG=FILE specifications */
+    int direct;
+    int scan;
+    int initrds_num;
+    const char *initrds[MAX_INITRDS];
+    const char *daemon;  /* control socket path, NULL unless running as daemon */
+    int bench;           /* number of runs of each kind to benchmark loading with, 0 to boot */
+    int remount;         /* REMOUNT_SYSRQ or REMOUNT_TARGETED */
+    int freeze;          /* freeze filesystems instead of remounting them where possible (targeted remount only) */
+    int stripelf;        /* load only headers and loadable segments of ELF kernel image */
 };
-const struct flags_t DEFAULT_FLAGS = { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 };
+const struct flags_t DEFAULT_FLAGS = { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 60, NULL, "X,Xorg,Xfbdev,Xwayland,weston,sway,kwin_wayland,mutter,cage", 1, NULL, 1, 0, 0, { NULL }, 0, 0, 0, { NULL }, NULL, 0, REMOUNT_SYSRQ, 0, 0 };
 
 struct kexec_info_t
 {
@@ -201,29 +346,256 @@ struct kexec_info_t
     uint32_t reserved[112];     /* total 128 uint32_t's */
 } __attribute__((packed));
 
+struct buffer_t
+{
+    void *addr;
+    size_t size;
+    int mapped;
+    int locked;
+};
+
+#define MAX_BUFFERS 8
+struct buffer_t buffers[MAX_BUFFERS];
+int buffers_num = 0;
+pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER; /* kernel and initrd are loaded concurrently */
+
+struct mount_t
+{
+    int id;
+    int parent;
+    dev_t dev;
+    int rw;
+    unsigned long mflags; /* per-mount MS_* flags, kept on remount */
+    char *path;
+    char *fstype;
+    double flush_ms;
+    int flush_err;
+    int todo;             /* to be remounted read-only */
+    int frozen;
+    int freeze_fd;        /* kept open while being frozen and frozen, to thaw it */
+    double remount_ms;
+    int remount_err;
+};
+
+#define FLUSH_WORKERS 4
+struct flush_t
+{
+    struct mount_t *mounts;
+    int mounts_num;
+    int next;
+    int workers_num;
+    pthread_mutex_t lock;
+    pthread_t workers[FLUSH_WORKERS];
+    struct timespec start;
+};
+
+struct worker_t
+{
+    pthread_t thread;
+    void *(*fn)(void *arg);
+    void *arg;
+    int code;       /* cancel() code if the worker failed, C_SUCCESS otherwise */
+    char msg[512];  /* cancel() message if the worker failed */
+    jmp_buf *jump;  /* set if run on caller's thread by run_inline() */
+};
+
+#define MAX_WORKERS 8
+struct worker_t *workers[MAX_WORKERS];
+int workers_num = 0;
+pthread_mutex_t workers_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread struct worker_t *current_worker = NULL;
+
+struct phase_t
+{
+    const char *name;
+    struct timespec start;
+    double ms;
+    u64 bytes;
+};
+
+#define MAX_PHASES 32
+struct phase_t phases[MAX_PHASES];
+int phases_num = 0;
+pthread_mutex_t phases_lock = PTHREAD_MUTEX_INITIALIZER;
+struct timespec run_start;
+
+char *current_cmdline = NULL; /* /proc/cmdline, read along with kernel image if needed */
+
+#define NVRAM_DUMP_OFFSET 6 /* sectors between NVRAM image and kexec_info in kexec jumper */
+struct kexec_info_t *jumper_info = NULL; /* kexec_info in loaded kexec jumper, if any */
+
+#define CACHE_MAGIC 0x45484341434b3245ull /* "E2KCACHE" */
+#define CACHE_VERSION 2
+
+struct cache_header_t
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t iskernel;
+    uint64_t key;
+    uint64_t content_hash;  /* of image, then of initrd */
+    uint64_t image_size;
+    uint64_t initrd_size;
+    int64_t jumper_offset;  /* offset of kexec_info in image, or -1 if none */
+    uint32_t noinitrd;
+    uint32_t reserved;
+};
+
+#define STDIN_CACHE_LIMIT 65536 /* Larger reads from stdin go directly to the destination instead of the cache */
+
+struct uring_t;
+
 struct lintelops
 {
     char *cache;
-    size_t cachesize;
+    size_t cachesize;   /* bytes cached from the start of stream */
+    size_t cachealloc;
     size_t fptr;
-
-    size_t (*fread)(void *ptr, size_t size, size_t nmemb, FILE *stream);
-    int (*fseek)(FILE *stream, long offset, int whence);
-    long (*ftell)(FILE *stream);
-    void (*rewind)(FILE *stream);
-    int (*fclose)(FILE *stream);
+    size_t streampos;   /* bytes consumed from stdin; equals cachesize until a bulk read bypasses the cache */
+    FILE *src;          /* stdin or a pipe, or NULL if the whole stream is already in cache (e.g. decompressed image) */
+
+    size_t (*fread)(struct lintelops *l, void *ptr, size_t size, size_t nmemb);
+    int (*fseek)(struct lintelops *l, long offset, int whence);
+    long (*ftell)(struct lintelops *l);
+    void (*rewind)(struct lintelops *l);
+    int (*fclose)(struct lintelops *l);
+    int (*fclaim)(struct lintelops *l, size_t size, struct buffer_t *buf); /* may be NULL; returns 0 if the data at current position is handed over without copying */
+
+    int fd;             /* regular file or block device read at arbitrary offsets, or -1 for streams; if set, cache is a bounce buffer holding cachesize bytes from streampos */
+    size_t dio_align;   /* 1 unless opened for direct I/O */
+    size_t fsize;
+    off_t base;         /* offset of BCD container in file, if found by scanning */
+    struct uring_t *ring; /* set up on first bulk read, NULL if io_uring is not used */
 };
 
-#ifndef AS_INCLUDE /* When used to determine sizeofs, skip all functions */
+static void forget_worker(struct worker_t *w)
+{
+    /* Workers are kept in order they were started, see stop_workers() */
+    pthread_mutex_lock(&workers_lock);
+    for (int i = 0; i < workers_num; ++i)
+    {
+        if (workers[i] == w)
+        {
+            memmove(&workers[i], &workers[i + 1], (--workers_num - i) * sizeof(workers[0]));
+            break;
+        }
+    }
+    pthread_mutex_unlock(&workers_lock);
+}
+
+static void stop_workers(void)
+{
+    /* Workers may write to image buffers, so they are stopped before atexit() handlers free them.
+       Lock is not held while joining, as the worker may be waiting for it to start or join workers of its own;
+       those come later in the list, so they are stopped after the one that would join them. */
+    for (;;)
+    {
+        pthread_mutex_lock(&workers_lock);
+        struct worker_t *w = workers_num ? workers[0] : NULL;
+        pthread_mutex_unlock(&workers_lock);
+        if (w == NULL) break;
+        pthread_cancel(w->thread);
+        pthread_join(w->thread, NULL);
+        forget_worker(w);
+    }
+}
+
 static void cancel(int num, const char *fmt, ...)
 {
     va_list ap;
     va_start(ap, fmt);
+    if (current_worker)
+    {
+        /* Worker threads don't exit the process; the failure is reported by the thread joining them */
+        vsnprintf(current_worker->msg, sizeof(current_worker->msg), fmt, ap);
+        va_end(ap);
+        current_worker->code = num;
+        if (current_worker->jump) longjmp(*current_worker->jump, 1);
+        pthread_exit(NULL);
+    }
     vprintf(fmt, ap);
     va_end(ap);
+    stop_workers();
     exit(num);
 }
 
+static void *worker_main(void *arg)
+{
+    current_worker = arg;
+    return current_worker->fn(current_worker->arg);
+}
+
+static int start_worker(struct worker_t *w, void *(*fn)(void *arg), void *arg)
+{
+    w->fn = fn;
+    w->arg = arg;
+    w->code = C_SUCCESS;
+    w->msg[0] = '\0';
+    w->jump = NULL;
+    pthread_mutex_lock(&workers_lock);
+    int e = (workers_num == MAX_WORKERS) ? EAGAIN : pthread_create(&w->thread, NULL, worker_main, w);
+    if (!e) workers[workers_num++] = w;
+    pthread_mutex_unlock(&workers_lock);
+    return e;
+}
+
+static int run_inline(struct worker_t *w, void *(*fn)(void *arg), void *arg)
+{
+    /* Job that could not be started as a worker is run on this thread, failing the same way: cancel() comes back here */
+    jmp_buf jump;
+    struct worker_t *outer = current_worker;
+    w->fn = fn;
+    w->arg = arg;
+    w->code = C_SUCCESS;
+    w->msg[0] = '\0';
+    w->jump = &jump;
+    current_worker = w;
+    if (!setjmp(jump)) fn(arg);
+    current_worker = outer;
+    w->jump = NULL;
+    return w->code;
+}
+
+static int join_worker(struct worker_t *w)
+{
+    /* Returns the worker's cancel() code; its message is left in w->msg */
+    pthread_join(w->thread, NULL);
+    forget_worker(w);
+    return w->code;
+}
+
+static double elapsed_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static int phase_begin(const char *name)
+{
+    /* Phases beyond the limit are silently not recorded */
+    pthread_mutex_lock(&phases_lock);
+    int n = (phases_num == MAX_PHASES) ? -1 : phases_num++;
+    pthread_mutex_unlock(&phases_lock);
+    if (n < 0) return -1;
+    struct phase_t *ph = &phases[n];
+    ph->name = name;
+    ph->bytes = 0;
+    ph->ms = -1;
+    clock_gettime(CLOCK_MONOTONIC, &ph->start);
+    return n;
+}
+
+static void phase_end(int n, u64 bytes)
+{
+    if (n < 0) return;
+    struct phase_t *ph = &phases[n];
+    ph->ms = elapsed_since(&ph->start);
+    ph->bytes = bytes;
+    if (bytes) printf("Phase %s took %.3f ms (%llu bytes, %.1f MB/s).\n", ph->name, ph->ms, (unsigned long long)bytes, ph->ms > 0 ? bytes / ph->ms / 1e3 : 0.0);
+    else printf("Phase %s took %.3f ms.\n", ph->name, ph->ms);
+}
+
 static int con2fbmap(int tty, glob_t* globbuf)
 {
     /* See con2fbmap by Michael J. Hammel: https://gitlab.com/pibox/con2fbmap */
@@ -237,6 +609,18 @@ static int con2fbmap(int tty, glob_t* globbuf)
         cancel(C_FBDEV_OPEN, "Can't open framebuffer device: %s\n", strerror(errno));
     }
     globfree(globbuf);
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && !S_ISCHR(st.st_mode))
+    {
+        /* Fake framebuffer device, like fake kexec one, just holds the number of framebuffer that consoles are mapped to */
+        char buf[16];
+        ssize_t r = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        buf[r > 0 ? r : 0] = '\0';
+        if (sscanf(buf, "%d", &map.framebuffer) != 1) cancel(C_FBDEV_IOCTL, "Can't read console mapping from fake framebuffer device\n");
+        return map.framebuffer;
+    }
     if (ioctl(fd, FBIOGET_CON2FBMAP, &map)) { close(fd); cancel(C_FBDEV_IOCTL, "Can't perform FBIOGET_CON2FBMAP ioctl: %s\n", strerror(errno)); }
     if (close(fd) == -1) cancel(C_FBDEV_CLOSE, "Can't close framebuffer device: %s\n", strerror(errno));
     return map.framebuffer;
@@ -274,23 +658,10 @@ static void path_snprintf(char *buf, const char *name, const char *fmt, ...)
     if(sz >= PATH_MAX) cancel(C_PATH_LONG, "Path to %s is greater than %d bytes", name, PATH_MAX - 1);
 }
 
-static void path_readlink(const char *link, char *buf, int nocancel)
+static const char *root_path(char *buf, const char *root, const char *rel)
 {
-    ssize_t ls = readlink(link, buf, PATH_MAX);
-    if (ls == -1)
-    {
-        if(nocancel)
-        {
-            buf[0] = '\0';
-            return;
-        }
-        else
-        {
-            cancel(C_LINK_READ, "Can't read symbolic link %s: %s\n", link, strerror(errno));
-        }
-    }
-    if (ls == PATH_MAX) cancel(C_LINK_LONG, "Path linked by %s is greater than %d bytes", link, PATH_MAX - 1);
-    buf[ls] = '\0';
+    path_snprintf(buf, rel, "%s%s", root, rel);
+    return buf;
 }
 
 static void read_sysfs(const char *file, char **buf, DIR *dir)
@@ -346,6 +717,90 @@ static void write_sysfs(const char *file, const char *buf)
     if(close(fd) == -1) cancel(C_SYSFS_CLOSEWRITE, "Can't close %s opened for writing: %s\n", file, strerror(errno));
 }
 
+/* Directories of sysfs attributes are looked up in; each is opened on first use and kept open till exit */
+enum { SYSFS_ROOT, SYSFS_PCI, SYSFS_BLOCK, SYSFS_VTCON, SYSFS_DIRS_NUM };
+const char *sysfs_dirs[SYSFS_DIRS_NUM] = { "", "/bus/pci/devices", "/dev/block", "/devices/virtual/vtconsole" };
+int sysfs_fds[SYSFS_DIRS_NUM] = { -1, -1, -1, -1 };
+pthread_mutex_t sysfs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define SYSFS_NAME_MAX 256 /* attribute paths relative to one of sysfs_dirs */
+
+static void sysfs_fail(int code, const char *action, int dir, const char *rel, int e)
+{
+    /* Every sysfs access error ends up here; full path is only put together for the message */
+    cancel(code, "Can't %s %s%s/%s: %s\n", action, sys_root, sysfs_dirs[dir], rel, strerror(e));
+}
+
+static void sysfs_name(char *buf, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int sz = vsnprintf(buf, SYSFS_NAME_MAX, fmt, ap);
+    va_end(ap);
+    if (sz >= SYSFS_NAME_MAX) cancel(C_PATH_LONG, "Path to sysfs attribute %s is greater than %d bytes\n", buf, SYSFS_NAME_MAX - 1);
+}
+
+static int sysfs_dir(int dir, int code)
+{
+    pthread_mutex_lock(&sysfs_lock);
+    int fd = sysfs_fds[dir], e = 0;
+    if (fd == -1)
+    {
+        char path[PATH_MAX];
+        if (path_snprintf_nc(path, "%s%s", sys_root, sysfs_dirs[dir])) e = ENAMETOOLONG;
+        else if ((fd = sysfs_fds[dir] = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) e = errno;
+    }
+    pthread_mutex_unlock(&sysfs_lock);
+    if (fd == -1) sysfs_fail(code, "open directory", dir, "", e);
+    return fd;
+}
+
+static DIR *sysfs_opendir(int dir, int code)
+{
+    /* Listing goes through a descriptor of its own, so the cached one stays usable */
+    int fd = openat(sysfs_dir(dir, code), ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *d = (fd == -1) ? NULL : fdopendir(fd);
+    if (d == NULL) { int e = errno; if (fd != -1) close(fd); sysfs_fail(code, "list directory", dir, "", e); }
+    return d;
+}
+
+static size_t sysfs_read(int dir, const char *rel, char *buf, size_t size)
+{
+    /* Attribute is read at once into caller's buffer, without trailing newline; returns its length */
+    int fd = openat(sysfs_dir(dir, C_SYSFS_OPENREAD), rel, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) sysfs_fail(C_SYSFS_OPENREAD, "open for reading", dir, rel, errno);
+    ssize_t r = pread(fd, buf, size - 1, 0);
+    int e = (r == 0) ? ENODATA : errno;
+    close(fd);
+    if (r < 1) sysfs_fail(C_SYSFS_READ, "read", dir, rel, e);
+    buf[r] = '\0';
+    if (buf[r - 1] == '\n') buf[--r] = '\0';
+    return r;
+}
+
+static void sysfs_write(int dir, const char *rel, const char *buf)
+{
+    int fd = openat(sysfs_dir(dir, C_SYSFS_OPENWRITE), rel, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) sysfs_fail(C_SYSFS_OPENWRITE, "open for writing", dir, rel, errno);
+    if (write(fd, buf, strlen(buf)) < 1) { int e = errno; close(fd); sysfs_fail(C_SYSFS_WRITE, "write", dir, rel, e); }
+    if (close(fd) == -1) sysfs_fail(C_SYSFS_CLOSEWRITE, "close after writing", dir, rel, errno);
+}
+
+static int sysfs_readlink(int dir, const char *rel, char *buf, int nocancel)
+{
+    /* buf is PATH_MAX bytes; returns -1 (with empty buf) only if nocancel is set */
+    ssize_t ls = readlinkat(sysfs_dir(dir, C_LINK_READ), rel, buf, PATH_MAX);
+    if (ls == -1 || ls == PATH_MAX)
+    {
+        buf[0] = '\0';
+        if (nocancel) return -1;
+        if (ls == -1) sysfs_fail(C_LINK_READ, "read symbolic link", dir, rel, errno);
+        sysfs_fail(C_LINK_LONG, "read symbolic link", dir, rel, ENAMETOOLONG);
+    }
+    buf[ls] = '\0';
+    return 0;
+}
+
 static void parse_pci_id(const char *context, char *pciid, uint32_t *domain, uint32_t *bus, uint32_t *dev, uint32_t *func)
 {
     char *s, *endp;
@@ -399,10 +854,8 @@ static char *strchrnul(const char *s, int c)
 
 static void unbind_vtcon(const char *signature)
 {
-    DIR *pdir;
-    if ((pdir = opendir("/sys/devices/virtual/vtconsole/")) == NULL) cancel(C_VTCON_OPENDIR, "Can't open vtconsole directory: %s\n", strerror(errno));
-
-    char bind[PATH_MAX];
+    DIR *pdir = sysfs_opendir(SYSFS_VTCON, C_VTCON_OPENDIR);
+    char bind[SYSFS_NAME_MAX];
     int correct = 0, bound = 0;
     while(!correct || !bound)
     {
@@ -420,72 +873,235 @@ static void unbind_vtcon(const char *signature)
 
         if (pdirent->d_name[0] == '.') continue;
 
-        char name[PATH_MAX];
-        if(path_snprintf_nc(name, "/sys/class/vtconsole/%s/name", pdirent->d_name) == -1)
+        char name[SYSFS_NAME_MAX];
+        if (snprintf(name, sizeof(name), "%s/name", pdirent->d_name) >= sizeof(name))
         {
             closedir(pdir);
-            cancel(C_VTCON_PATHLONG, "Path to virtual console name is greater than %d bytes", PATH_MAX - 1);
+            cancel(C_VTCON_PATHLONG, "Path to virtual console name is greater than %d bytes", SYSFS_NAME_MAX - 1);
         }
 
-        if(path_snprintf_nc(bind, "/sys/class/vtconsole/%s/bind", pdirent->d_name) == -1)
+        if (snprintf(bind, sizeof(bind), "%s/bind", pdirent->d_name) >= sizeof(bind))
         {
             closedir(pdir);
-            cancel(C_VTCON_BINDLONG, "Path to virtual console bind command pseudofile is greater than %d bytes", PATH_MAX - 1);
+            cancel(C_VTCON_BINDLONG, "Path to virtual console bind command pseudofile is greater than %d bytes", SYSFS_NAME_MAX - 1);
         }
 
-        char *vtcon_bind;
-        read_sysfs(bind, &vtcon_bind, pdir);
-        bound = (vtcon_bind[0] == '1');
-        free(vtcon_bind);
+        char value[128];
+        sysfs_read(SYSFS_VTCON, bind, value, sizeof(value));
+        bound = (value[0] == '1');
 
-        char *vtcon_name;
-        read_sysfs(name, &vtcon_name, pdir);
-        *strchrnul(vtcon_name, '\n') = '\0';
-        printf ("Console %s is %s, %s.\n", pdirent->d_name, vtcon_name, bound ? "active" : "inactive");
-        correct = (strstr(vtcon_name, signature) != NULL);
-        free(vtcon_name);
+        sysfs_read(SYSFS_VTCON, name, value, sizeof(value));
+        printf ("Console %s is %s, %s.\n", pdirent->d_name, value, bound ? "active" : "inactive");
+        correct = (strstr(value, signature) != NULL);
     }
 
     if(closedir(pdir)) cancel(C_VTCON_CLOSEDIR, "Can't close vtconsole directory: %s\n", strerror(errno));
     printf("Active %s is found. Unbinding...\n", signature);
-    write_sysfs(bind, "0\n");
+    sysfs_write(SYSFS_VTCON, bind, "0\n");
 }
 
-static void reset_devices(const char *bridgeid)
+struct pcidev_t
 {
-    char devpattern[PATH_MAX];
-    path_snprintf(devpattern, "PCI bridge subdevice pattern", "/sys/bus/pci/devices/%s/????:??:??.*", bridgeid);
-        
-    glob_t globbuf;
-    switch(glob(devpattern, GLOB_ERR, NULL, &globbuf))
+    char path[SYSFS_NAME_MAX]; /* directory of device, relative to SYSFS_PCI */
+    int depth;           /* 0 for bridge's own children */
+    int error;           /* errno if removal request failed */
+    double ms;           /* time removal request took */
+    int confirmed;       /* removal announced by kernel */
+};
+
+struct pcitree_t
+{
+    struct pcidev_t *devs;
+    int num;
+    int alloc;
+    int level;           /* depth being removed now */
+    int next;
+    int dirfd;           /* SYSFS_PCI directory, device paths are relative to it */
+    pthread_mutex_t lock;
+};
+
+#define MAX_PCI_DEPTH 8
+#define MAX_REMOVE_THREADS 16
+#define UEVENT_TIMEOUT 5000 /* ms to wait for kernel to announce removal of a level of devices */
+
+static int is_pci_dev(const struct dirent *e)
+{
+    return !fnmatch("????:??:??.*", e->d_name, 0);
+}
+
+static void collect_pci(struct pcitree_t *t, const char *dir, int depth)
+{
+    /* Children of bridges behind the bridge are collected too, so that they can be removed first */
+    struct dirent **names;
+    int num = scandirat(sysfs_dir(SYSFS_PCI, C_BRGLOB_ABORT), dir, &names, is_pci_dev, alphasort);
+    if (num == -1 && errno == ENOMEM) cancel(C_BRGLOB_ALLOC, "No memory looking for bridge subdevices\n");
+    if (num == -1) sysfs_fail(C_BRGLOB_ABORT, "list directory", SYSFS_PCI, dir, errno);
+    if (num == 0 && depth == 0) cancel(C_BRGLOB_SYSFS, "No bridge subdevices sysfs subdirectory exist; something is completely wrong with your sysfs.\n");
+
+    for (int n = 0; n < num; ++n)
     {
-        case 0:
-            break;
+        if (t->num == t->alloc)
+        {
+            struct pcidev_t *d = realloc(t->devs, (t->alloc = t->alloc ? t->alloc * 2 : 8) * sizeof(struct pcidev_t));
+            if (d == NULL) cancel(C_BRGLOB_ALLOC, "No memory looking for bridge subdevices\n");
+            t->devs = d;
+        }
+        /* Own copy of path is passed down, as devs[] may be moved by then */
+        char path[SYSFS_NAME_MAX];
+        sysfs_name(path, "%s/%s", dir, names[n]->d_name);
+        free(names[n]);
+        struct pcidev_t *d = &t->devs[t->num++];
+        memcpy(d->path, path, sizeof(path));
+        d->depth = depth;
+        d->error = 0;
+        d->ms = 0;
+        d->confirmed = 0;
+        if (depth < MAX_PCI_DEPTH) collect_pci(t, path, depth + 1);
+    }
+    free(names);
+}
 
-        case GLOB_NOMATCH:
-            globfree(&globbuf);
-            cancel(C_BRGLOB_SYSFS, "No bridge subdevices sysfs subdirectory exist; something is completely wrong with your sysfs.\n");
+static void *remove_worker(void *arg)
+{
+    struct pcitree_t *t = arg;
+    for (;;)
+    {
+        pthread_mutex_lock(&t->lock);
+        while (t->next < t->num && t->devs[t->next].depth != t->level) ++t->next;
+        int n = (t->next < t->num) ? t->next++ : -1;
+        pthread_mutex_unlock(&t->lock);
+        if (n < 0) break;
+
+        /* Errors are not fatal here, they are reported once the whole level is done */
+        struct pcidev_t *d = &t->devs[n];
+        char pciremove[SYSFS_NAME_MAX];
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (snprintf(pciremove, sizeof(pciremove), "%s/remove", d->path) >= sizeof(pciremove)) { d->error = ENAMETOOLONG; continue; }
+        int fd = openat(t->dirfd, pciremove, O_WRONLY | O_CLOEXEC);
+        if (fd == -1 || write(fd, "1\n", 2) < 1) d->error = errno;
+        if (fd != -1 && close(fd) == -1 && !d->error) d->error = errno;
+        d->ms = elapsed_since(&start);
+    }
+    return NULL;
+}
 
-        case GLOB_NOSPACE:
-            globfree(&globbuf);
-            cancel(C_BRGLOB_ALLOC, "No memory looking for bridge subdevices\n");
+static int uevent_open(void)
+{
+    /* Kernel announces removed devices here; -1 if it can't be listened to (e.g. in a container, or with fixture sysfs tree) */
+    if (strcmp(sys_root, "/sys")) return -1;
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (fd == -1) return -1;
+    int size = 1 << 20;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size))) setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1; /* Kernel events, not the ones relayed by udev */
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) { close(fd); return -1; }
+    return fd;
+}
 
-        case GLOB_ABORTED:
-            globfree(&globbuf);
-            cancel(C_BRGLOB_ABORT, "Read error looking for bridge subdevices\n");
+static const char *uevent_removed(char *buf, size_t n)
+{
+    /* Message is "action@devpath" followed by KEY=value strings, all zero-terminated; buf has room for one more byte.
+       Returns id of PCI device the message announces removal of, or NULL */
+    const char *action = NULL, *devpath = NULL, *subsystem = NULL;
+    buf[n] = '\0';
+    for (const char *s = buf; s < buf + n; s += strlen(s) + 1)
+    {
+        if (!strncmp(s, "ACTION=", 7)) action = s + 7;
+        else if (!strncmp(s, "DEVPATH=", 8)) devpath = s + 8;
+        else if (!strncmp(s, "SUBSYSTEM=", 10)) subsystem = s + 10;
+    }
+    if (action == NULL || devpath == NULL || subsystem == NULL || strcmp(action, "remove") || strcmp(subsystem, "pci")) return NULL;
+    const char *id = strrchr(devpath, '/');
+    return id ? id + 1 : devpath;
+}
 
-        default:
-            globfree(&globbuf);
-            cancel(C_BRGLOB_UNEXPECTED, "Unexpected error looking for bridge subdevices, internal result: %s\n", strerror(errno));
+static int uevent_match(struct pcitree_t *t, const char *id)
+{
+    /* Marks device of current level as confirmed removed; returns number of devices confirmed */
+    int confirmed = 0;
+    for (int i = 0; i < t->num; ++i)
+    {
+        struct pcidev_t *d = &t->devs[i];
+        const char *did = strrchr(d->path, '/');
+        if (d->depth != t->level || d->confirmed || d->error || strcmp(did ? did + 1 : d->path, id)) continue;
+        d->confirmed = 1;
+        ++confirmed;
+    }
+    return confirmed;
+}
+
+static void uevent_confirm(int fd, struct pcitree_t *t, int pending)
+{
+    /* Waits until kernel announces removal of every device of current level that was requested */
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char buf[8192];
+    while (pending > 0)
+    {
+        long left = UEVENT_TIMEOUT - (long)elapsed_since(&start);
+        if (left <= 0) break;
+        struct pollfd p = { fd, POLLIN, 0 };
+        int r = poll(&p, 1, left);
+        if (r == -1 && errno == EINTR) continue;
+        if (r <= 0) break;
+        struct sockaddr_nl from;
+        socklen_t fromlen = sizeof(from);
+        ssize_t n = recvfrom(fd, buf, sizeof(buf) - 1, 0, (struct sockaddr *)&from, &fromlen);
+        if (n <= 0 || from.nl_pid != 0) continue;
+        const char *id = uevent_removed(buf, n);
+        if (id) pending -= uevent_match(t, id);
     }
+}
 
-    for(size_t n = 0; n < globbuf.gl_pathc; ++n)
+static void reset_devices(const char *bridgeid)
+{
+    /* Devices are removed level by level starting from the deepest one, all devices of a level at once */
+    struct pcitree_t t = { NULL, 0, 0 };
+    collect_pci(&t, bridgeid, 0);
+    t.dirfd = sysfs_dir(SYSFS_PCI, C_BRGLOB_ABORT);
+    int maxdepth = 0;
+    for (int i = 0; i < t.num; ++i) if (t.devs[i].depth > maxdepth) maxdepth = t.devs[i].depth;
+
+    /* Listening starts before the first removal, so that no announcement is missed */
+    int ufd = uevent_open();
+    if (ufd == -1) printf("Can't listen to kernel uevents, PCI devices removal won't be confirmed.\n");
+    pthread_mutex_init(&t.lock, NULL);
+    for (t.level = maxdepth; t.level >= 0; --t.level)
     {
-        char pciremove[PATH_MAX];
-        path_snprintf(pciremove, "PCI device removal command pseudofile", "%s/remove", globbuf.gl_pathv[n]);
-        printf("Removing PCI device %s.\n", globbuf.gl_pathv[n]);
-        write_sysfs(pciremove, "1\n");
+        int level_num = 0;
+        for (int i = 0; i < t.num; ++i) if (t.devs[i].depth == t.level) { printf("Removing PCI device %s%s/%s.\n", sys_root, sysfs_dirs[SYSFS_PCI], t.devs[i].path); ++level_num; }
+        t.next = 0;
+        int threads_num = (level_num > MAX_REMOVE_THREADS) ? MAX_REMOVE_THREADS : level_num;
+        pthread_t threads[threads_num];
+        int started = 0;
+        while (started < threads_num - 1 && !pthread_create(&threads[started], NULL, remove_worker, &t)) ++started;
+        remove_worker(&t);
+        for (int i = 0; i < started; ++i) pthread_join(threads[i], NULL);
+
+        int pending = 0;
+        for (int i = 0; i < t.num; ++i)
+        {
+            struct pcidev_t *d = &t.devs[i];
+            if (d->depth != t.level) continue;
+            if (d->error) { int e = d->error; if (ufd != -1) close(ufd); pthread_mutex_destroy(&t.lock); sysfs_fail(C_SYSFS_WRITE, "remove PCI device", SYSFS_PCI, d->path, e); }
+            ++pending;
+        }
+        if (ufd != -1) uevent_confirm(ufd, &t, pending);
+        for (int i = 0; i < t.num; ++i)
+        {
+            struct pcidev_t *d = &t.devs[i];
+            if (d->depth != t.level) continue;
+            printf("Removed PCI device %s%s/%s in %.3f ms%s.\n", sys_root, sysfs_dirs[SYSFS_PCI], d->path, d->ms, (ufd == -1 || d->confirmed) ? "" : ", but kernel did not confirm it");
+        }
     }
+    pthread_mutex_destroy(&t.lock);
+    if (ufd != -1) close(ufd);
+    printf("Removed %d PCI devices in %d levels.\n", t.num, maxdepth + 1);
+    free(t.devs);
 }
 
 static void reset_fbdriver(int tty, const struct flags_t flags)
@@ -493,42 +1109,41 @@ static void reset_fbdriver(int tty, const struct flags_t flags)
     /* Current kernels require specific adapter reset sequence to be performed before kexec. */
 
     char pcilnk[PATH_MAX];
-    char *pciid;
+    char *pciid = NULL;
     char drivermod[PATH_MAX];
-    char *modname;
+    char *modname = NULL;
     char pciabsdev[PATH_MAX];
-    char *pcibridge;
+    char *pcibridge = NULL;
     int fb;
+    int ph = phase_begin("reset_fbdriver.detect");
 
     if(flags.rmmod || flags.rmpci || flags.vtunbind)
     {
         if (tty < 0)
         {
-            const char active_file[] = "/sys/class/tty/tty0/active";
-            char *active_tty, *endp;
-            struct stat st;
-            if (stat(active_file, &st) != 0) cancel(C_FBDEV_TTYSTAT, "Can't stat() %s (maybe you don't have tty enabled, try -t <N> if you have): %s\n", active_file, strerror(errno));
-            read_sysfs(active_file, &active_tty, NULL);
+            const char *active_file = "class/tty/tty0/active";
+            char active_tty[32], *endp;
+            if (faccessat(sysfs_dir(SYSFS_ROOT, C_FBDEV_TTYSTAT), active_file, F_OK, 0) != 0) cancel(C_FBDEV_TTYSTAT, "Can't stat() %s/%s (maybe you don't have tty enabled, try -t <N> if you have): %s\n", sys_root, active_file, strerror(errno));
+            sysfs_read(SYSFS_ROOT, active_file, active_tty, sizeof(active_tty));
             errno = 0;
-            *strchrnul(active_tty, '\n') = '\0';
             printf("Active tty: %s\n", active_tty);
-            if (!active_tty || strlen(active_tty) < 4 || strncmp(active_tty, "tty", 3) || (tty = strtol(&(active_tty[3]), &endp, 10)) <= 0 || errno || *endp)
+            if (strlen(active_tty) < 4 || strncmp(active_tty, "tty", 3) || (tty = strtol(&(active_tty[3]), &endp, 10)) <= 0 || errno || *endp)
             {
-                free(active_tty);
-                cancel(C_FBDEV_TTYWRONG, "Incorrect data in %s, can't autodetect active tty. Use -t <N> to specify it\n", active_file);
+                cancel(C_FBDEV_TTYWRONG, "Incorrect data in %s/%s, can't autodetect active tty. Use -t <N> to specify it\n", sys_root, active_file);
             }
-            free(active_tty);
         }
 
         glob_t globbuf;
-        switch(glob("/dev/fb*", GLOB_ERR, NULL, &globbuf))
+        char fbpattern[PATH_MAX];
+        switch(glob(root_path(fbpattern, dev_root, "/fb*"), GLOB_ERR, NULL, &globbuf))
         {
             case 0:
                 break;
 
             case GLOB_NOMATCH:
                 globfree(&globbuf);
-                printf("No /dev/fb* exist; you might have no video adapter, or use VGA console instead of framebuffer one.\n");
+                printf("No %s exist; you might have no video adapter, or use VGA console instead of framebuffer one.\n", fbpattern);
+                phase_end(ph, 0);
                 return;
 
             case GLOB_NOSPACE:
@@ -550,80 +1165,201 @@ static void reset_fbdriver(int tty, const struct flags_t flags)
         if (fb == -1)
         {
             printf("No console is mapped to frame buffer device; you might have no video adapter, or use VGA console instead of framebuffer one.\n");
+            phase_end(ph, 0);
             return;
         }
         printf("Active framebuffer device is fb%d.\n", fb);
 
-        char fbdev[PATH_MAX];
-        path_snprintf(fbdev, "PCI device link", "/sys/class/graphics/fb%d/device", fb);
-        path_readlink(fbdev, pcilnk, 0);
+        char fbdev[SYSFS_NAME_MAX];
+        sysfs_name(fbdev, "class/graphics/fb%d/device", fb);
+        sysfs_readlink(SYSFS_ROOT, fbdev, pcilnk, 0);
         pciid = quick_basename(pcilnk);
 
         if (!strncmp(pciid, "vga16fb", 7))
         {
             printf("Framebuffer console is %s, no need to reset.\n", pciid);
+            phase_end(ph, 0);
             return;
         }
     }
 
     if(flags.rmmod)
     {
-        char driverlnk[PATH_MAX];
-        path_snprintf(driverlnk, "PCI device driver symlink", "/sys/bus/pci/devices/%s/driver", pciid);
-        path_readlink(driverlnk, drivermod, 0);
+        char driverlnk[SYSFS_NAME_MAX];
+        sysfs_name(driverlnk, "%s/driver", pciid);
+        sysfs_readlink(SYSFS_PCI, driverlnk, drivermod, 0);
         modname = quick_basename(drivermod);
     }
 
     if(flags.rmpci)
     {
-        char pcidev[PATH_MAX];
-        path_snprintf(pcidev, "PCI device instance directory", "/sys/bus/pci/devices/%s", pciid);
-        path_readlink(pcidev, pciabsdev, 0);
+        sysfs_readlink(SYSFS_PCI, pciid, pciabsdev, 0);
         pcibridge = quick_basename(quick_dirname(pciabsdev));
         printf("Active video device parent PCI bridge is %s.\n", pcibridge);
     }
+    phase_end(ph, 0);
 
     if(flags.vtunbind)
     {
+        ph = phase_begin("reset_fbdriver.vtunbind");
         unbind_vtcon("frame buffer device");
+        phase_end(ph, 0);
     }
 
     if(flags.rmpci)
     {
+        ph = phase_begin("reset_fbdriver.rmpci");
         reset_devices(pcibridge);
+        phase_end(ph, 0);
     }
 
     if(flags.rmmod)
     {
+        ph = phase_begin("reset_fbdriver.rmmod");
         printf("Unloading module %s.\n", modname);
         delete_module(modname);
+        phase_end(ph, 0);
+    }
+}
+
+struct probe_t
+{
+    dev_t dev;
+    char path[PATH_MAX];
+    int result; /* 1 if BCD signature found, 0 if not, -errno on error */
+};
+
+struct probes_t
+{
+    struct probe_t *probes;
+    int num;
+    int next;
+    pthread_mutex_t lock;
+};
+
+#define MAX_PROBE_THREADS 32
+
+static int probe_bcd(const char *path)
+{
+    /* BCD header is in sector 1; whole page is read, so that direct I/O works on 4K sector disks too */
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_DIRECT);
+    if (fd == -1 && errno == EINVAL) fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -errno;
+    void *buf;
+    if (posix_memalign(&buf, alignment, alignment)) { close(fd); return -ENOMEM; }
+    ssize_t r = pread(fd, buf, alignment, 0);
+    if (r == -1 && errno == EINVAL)
+    {
+        int fl = fcntl(fd, F_GETFL);
+        if (fl != -1 && fcntl(fd, F_SETFL, fl & ~O_DIRECT) == 0) r = pread(fd, buf, alignment, 0);
+    }
+    int e = errno;
+    close(fd);
+    int found = (r >= 512 + (ssize_t)sizeof(uint64_t)) && !memcmp((char*)buf + 512, &LINTEL_BCD_SIGNATURE, sizeof(uint64_t));
+    free(buf);
+    return (r == -1) ? -e : found;
+}
+
+static void *probe_worker(void *arg)
+{
+    struct probes_t *p = arg;
+    for (;;)
+    {
+        pthread_mutex_lock(&p->lock);
+        int n = p->next++;
+        pthread_mutex_unlock(&p->lock);
+        if (n >= p->num) break;
+        p->probes[n].result = probe_bcd(p->probes[n].path);
+    }
+    return NULL;
+}
+
+static void find_bcd_disk(char *path, const dev_t *bootdisk)
+{
+    /* Every SATA and NVMe disk is probed at once, as it's just one sector to read from each, mostly waiting for disks */
+    DIR *d = sysfs_opendir(SYSFS_BLOCK, C_AUTO_SCAN);
+    struct probes_t p = { NULL, 0, 0 };
+    int alloc = 0;
+    struct dirent *e;
+    while ((e = readdir(d)))
+    {
+        unsigned int maj, min;
+        char c, target[PATH_MAX];
+        if (sscanf(e->d_name, "%u:%u%c", &maj, &min, &c) != 2) continue;
+        if (sysfs_readlink(SYSFS_BLOCK, e->d_name, target, 1)) continue;
+        if (!strstr(target, "/ata") && !strstr(target, "/nvme")) continue;
+
+        /* Only whole disks are probed, not partitions */
+        char partfile[SYSFS_NAME_MAX];
+        sysfs_name(partfile, "%s/partition", e->d_name);
+        if (faccessat(sysfs_dir(SYSFS_BLOCK, C_AUTO_SCAN), partfile, F_OK, 0) == 0) continue;
+
+        if (p.num == alloc)
+        {
+            struct probe_t *n = realloc(p.probes, (alloc = alloc ? alloc * 2 : 16) * sizeof(struct probe_t));
+            if (n == NULL) { free(p.probes); closedir(d); cancel(C_AUTO_SCAN, "Can't allocate memory to probe disks\n"); }
+            p.probes = n;
+        }
+        struct probe_t *probe = &p.probes[p.num];
+        probe->dev = makedev(maj, min);
+        probe->result = 0;
+        if (path_snprintf_nc(probe->path, "%s/%s", dev_root, quick_basename(target))) continue;
+        ++p.num;
+    }
+    closedir(d);
+    if (p.num == 0) cancel(C_AUTO_NONE, "No SATA or NVMe disks found to look for lintel BCD image on\n");
+
+    pthread_mutex_init(&p.lock, NULL);
+    int threads_num = (p.num > MAX_PROBE_THREADS) ? MAX_PROBE_THREADS : p.num;
+    pthread_t threads[threads_num];
+    int started = 0;
+    while (started < threads_num - 1 && !pthread_create(&threads[started], NULL, probe_worker, &p)) ++started;
+    probe_worker(&p);
+    for (int i = 0; i < started; ++i) pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&p.lock);
+
+    int found = 0, chosen = -1;
+    for (int i = 0; i < p.num; ++i)
+    {
+        if (p.probes[i].result < 0) printf("Can't probe %s for lintel BCD image: %s\n", p.probes[i].path, strerror(-p.probes[i].result));
+        if (p.probes[i].result <= 0) continue;
+        printf("Found lintel BCD image on %s.\n", p.probes[i].path);
+        ++found;
+        if (chosen == -1 || (bootdisk && p.probes[i].dev == *bootdisk)) chosen = i;
+    }
+    printf("Probed %d disks using %d threads.\n", p.num, threads_num);
+    if (found == 0) { free(p.probes); cancel(C_AUTO_NONE, "No lintel BCD image found on any disk\n"); }
+    if (found > 1)
+    {
+        /* Older lintel without kexec jumper picks the first one it finds, so duplicates are an error unless boot disk is given explicitly */
+        if (bootdisk == NULL || p.probes[chosen].dev != *bootdisk) { free(p.probes); cancel(C_AUTO_AMBIG, "Lintel BCD image found on %d disks; specify the one to use as FILE, or boot disk with -d\n", found); }
+        printf("Lintel BCD image found on %d disks, using the one on boot disk.\n", found);
     }
+    strcpy(path, p.probes[chosen].path);
+    free(p.probes);
 }
 
 static void fill_disk_data(struct kexec_info_t *kexec_info, dev_t dev, int chkdisknode)
 {
-    char blklink[PATH_MAX];
+    char blklink[SYSFS_NAME_MAX];
     char blkabsdev[PATH_MAX];
-    path_snprintf(blklink, "Block device sysfs link", "/sys/dev/block/%d:%d", major(dev), minor(dev));
-    path_readlink(blklink, blkabsdev, 0);
+    sysfs_name(blklink, "%d:%d", major(dev), minor(dev));
+    sysfs_readlink(SYSFS_BLOCK, blklink, blkabsdev, 0);
     char *ataport = strstr(blkabsdev, "/ata");
-    if (ataport == NULL) cancel(C_DISKDEV_NONATA, "Device %s is not an ATA device.\n", blklink);
+    if (ataport == NULL) cancel(C_DISKDEV_NONATA, "Device %s%s/%s is not an ATA device.\n", sys_root, sysfs_dirs[SYSFS_BLOCK], blklink);
     *ataport++ = '\0';
     *strchrnul(ataport, '/') = '\0';
     char *pcidev = quick_basename(blkabsdev);
 
-    char portfile[PATH_MAX];
-    path_snprintf(portfile, "Block device sysfs port number", "/sys/bus/pci/devices/%s/%s/ata_port/%s/port_no", pcidev, ataport, ataport);
-    char *portnum, *endp;
-    read_sysfs(portfile, &portnum, NULL);
+    char portfile[SYSFS_NAME_MAX];
+    sysfs_name(portfile, "%s/%s/ata_port/%s/port_no", pcidev, ataport, ataport);
+    char portnum[32], *endp;
+    sysfs_read(SYSFS_PCI, portfile, portnum, sizeof(portnum));
     errno = 0;
-    *strchrnul(portnum, '\n') = '\0';
     if ((kexec_info->boot_disk_sata_port = strtol(portnum, &endp, 10)) <= 0 || errno || *endp)
     {
-        free(portnum);
-        cancel(C_DISKDEV_WRONGPORT, "Incorrect data in %s (%s). Should usually be 1 to 4 (or more on modern controllers)\n", portfile, portnum);
+        cancel(C_DISKDEV_WRONGPORT, "Incorrect data in %s%s/%s (%s). Should usually be 1 to 4 (or more on modern controllers)\n", sys_root, sysfs_dirs[SYSFS_PCI], portfile, portnum);
     }
-    free(portnum);
 
     --kexec_info->boot_disk_sata_port;
     parse_pci_id("for the boot drive PCI device", pcidev, &kexec_info->boot_disk_pci_addr_node, &kexec_info->boot_disk_pci_addr_bus, &kexec_info->boot_disk_pci_addr_slot, &kexec_info->boot_disk_pci_addr_func);
@@ -654,7 +1390,8 @@ static void check_runlevel(void)
         if (errno && errno != ENOENT) cancel(C_RUNLEVEL_FAIL, "Can't get current runlevel: %s\n", strerror(errno));
 
         char *initstr;
-        read_sysfs("/proc/1/cmdline",&initstr,NULL);
+        char initfile[PATH_MAX];
+        read_sysfs(root_path(initfile, proc_root, "/1/cmdline"),&initstr,NULL);
         *strchrnul(initstr, ' ') = '\0';
         char *init = quick_basename(initstr);
         /* Feel free to add any other shell you may somehow use as init in your boot config and make a pull request with that change. */
@@ -676,110 +1413,337 @@ static void check_runlevel(void)
 
 static void free_static(void)
 {
-    if (lintel.image) free(lintel.image);
-    if (kernel.image) free(kernel.image);
-    if (kernel.initrd) free(kernel.initrd);
+    for (int i = 0; i < buffers_num; ++i)
+    {
+        if (buffers[i].locked) munlock(buffers[i].addr, buffers[i].size);
+        if (buffers[i].mapped) munmap(buffers[i].addr, buffers[i].size);
+        else free(buffers[i].addr);
+    }
+    buffers_num = 0;
 }
 
-static void read_image(struct lintelops *l, FILE *f, size_t realsize, void **out_buf, u64 *out_size, const char *what)
+static void lock_buffer(struct buffer_t *buf)
 {
-    *out_size = realsize; /* Note: this should EXACTLY match the lintel binary size, because it is used to calculate jump address (mcstbug#133402 comment 38) */
-    size_t aligned_size = realsize + alignment; aligned_size -= aligned_size % alignment;
-    if (posix_memalign(out_buf, alignment, aligned_size)) { l->fclose(f); cancel(C_FILE_ALLOC, "Can't allocate %ld bytes for %s file of %ld bytes\n", aligned_size, what, *out_size); }
-    if (l->fread(*out_buf, *out_size, 1, f) != 1) { l->fclose(f); cancel(C_FILE_READ, "Can't read %ld bytes for %s file, file might be truncated\n", *out_size, what); }
-    printf("Loaded %s: %ld bytes at address %p (%ld bytes aligned at 0x%lx)\n", what, *out_size, *out_buf, aligned_size, alignment);
-    if(l->fclose(f)) cancel(C_FILE_CLOSE, "Can't close %s file\n", what);
+    /* Pages that are not resident yet get locked as they are faulted in, so private file mappings don't get copied just to be locked */
+    static int warned = 0;
+    if (!lock_images || buf->locked) return;
+#ifdef SYS_mlock2
+    if (syscall(SYS_mlock2, buf->addr, buf->size, MLOCK_ONFAULT) == 0) { buf->locked = 1; return; }
+    if (errno != ENOSYS && errno != EINVAL) goto fail;
+#endif
+    /* Plain mlock() would copy every page of a private file mapping, so it is used only for anonymous memory */
+    if (!buf->mapped && mlock(buf->addr, buf->size) == 0) { buf->locked = 1; return; }
+#ifdef SYS_mlock2
+fail:
+#endif
+    if (!warned) printf("Can't lock image buffers in memory (%s), their pages may be swapped out before reboot.\n", buf->mapped ? "not supported by kernel" : strerror(errno));
+    warned = 1;
 }
 
-static struct xrt_BcdHeader_t bcd_check_files(struct lintelops *l, FILE *f)
+static size_t huge_page_size(void)
 {
-    if (l->fseek(f, 512, SEEK_SET) != 0) { l->fclose(f); cancel(C_BCD_SEEK, "Can't seek to possible header of file: %s\n", strerror(errno)); }
-    struct xrt_BcdHeader_t header;
-    if (l->fread(&header, sizeof(header), 1, f) != 1) { l->fclose(f); cancel(C_BCD_HEADER, "Can't read header of lintel file, file might be truncated\n"); }
-    if (header.signature != LINTEL_BCD_SIGNATURE) header.files_num = -1;
-    return header;
+    /* Default huge page size, as reported by kernel; 0 if unknown */
+    char path[PATH_MAX], line[128];
+    unsigned long kb = 0;
+    root_path(path, proc_root, "/meminfo");
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return 0;
+    while (fgets(line, sizeof(line), f)) if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1) break;
+    fclose(f);
+    return kb * 1024;
 }
 
-static void patch_jumper_info(const struct xrt_BcdFile_t super_file)
+static const char *alloc_huge(size_t size, struct buffer_t *buf)
 {
-    printf("BCD file contains kexec jumper, patching the header.\n");
+    /* Returns kind of huge pages the buffer is in, or NULL if there are none available */
+    size_t hsize = huge_page_size();
+    if (hsize == 0 || hsize % alignment) return NULL;
+    size_t mapsize = (size + hsize - 1) / hsize * hsize;
+
+    /* Explicit huge pages are taken if reserved by administrator, they are never swapped and come prefaulted */
+    void *p = mmap(NULL, mapsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    if (p != MAP_FAILED)
+    {
+        *buf = (struct buffer_t){ p, mapsize, 1, 0 };
+        return "explicit";
+    }
 
-    struct xrt_BcdHeader_t *subheader = (struct xrt_BcdHeader_t*)((char*)lintel.image + (super_file.init_size - 1) * 512); /* BCD map should be located in the last sector of lintel file */
-    if (subheader->signature != LINTEL_BCD_SIGNATURE) cancel(C_SUPER_HEADER, "Can't find BCD signature in super file\n");
-    struct xrt_BcdFile_t *files = (struct xrt_BcdFile_t*)((char*)subheader + sizeof(struct xrt_BcdHeader_t));
-    for (uint32_t i = 0; i < subheader->files_num; ++i)
+    /* Otherwise, ask for transparent huge pages, which need huge page aligned area */
+    p = mmap(NULL, mapsize + hsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return NULL;
+    char *a = (char *)(((uintptr_t)p + hsize - 1) & ~(uintptr_t)(hsize - 1));
+    if (a > (char *)p) munmap(p, a - (char *)p);
+    munmap(a + mapsize, (char *)p + hsize - a);
+    if (madvise(a, mapsize, MADV_HUGEPAGE)) { munmap(a, mapsize); return NULL; }
+
+    /* Prefault now, so that neither reading image nor kexec copying it later stumbles on page faults */
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(a, mapsize, MADV_POPULATE_WRITE))
+#endif
     {
-        if ( files[i].tag == PRIORITY_TAG_KEXEC_JUMPER )
-        {
-            files[i].lba = super_file.lba;
-            files[i].size = super_file.size;
-            return;
-        }
+        long pagesize = sysconf(_SC_PAGESIZE);
+        for (size_t i = 0; i < mapsize; i += (pagesize > 0) ? pagesize : alignment) ((volatile char *)a)[i] = 0;
     }
-    cancel(C_SUPER_JUMPER, "Can't find kexec jumper in super file\n");
+    *buf = (struct buffer_t){ a, mapsize, 1, 0 };
+    return "transparent";
 }
 
-static void inject_kexec_info(const struct kexec_info_t *source, struct kexec_info_t *target, const char *nvram, struct flags_t *flags)
+static void add_buffer(struct buffer_t *buf)
 {
-    if (target->signature == 0x61746164)
+    /* We never load more than a few images at once, so running out of slots is an internal error */
+    lock_buffer(buf);
+    pthread_mutex_lock(&buffers_lock);
+    if (buffers_num == MAX_BUFFERS)
     {
-        switch(target->version)
-        {
-            case 0x01000000:
-                memset(&(((uint32_t*)target)[3]), 0xff, target->size - 3 * sizeof(uint32_t));
-                target->interactive             = source->interactive;
-                target->boot_disk_pci_addr_node = source->boot_disk_pci_addr_node;
-                target->boot_disk_pci_addr_bus  = source->boot_disk_pci_addr_bus;
-                target->boot_disk_pci_addr_slot = source->boot_disk_pci_addr_slot;
-                target->boot_disk_pci_addr_func = source->boot_disk_pci_addr_func;
-                target->boot_disk_sata_port     = source->boot_disk_sata_port;
-                target->vga_pci_addr_node       = source->vga_pci_addr_node;
-                target->vga_pci_addr_bus        = source->vga_pci_addr_bus;
-                target->vga_pci_addr_slot       = source->vga_pci_addr_slot;
-                target->vga_pci_addr_func       = source->vga_pci_addr_func;
-                target->eth_emul_regime         = source->eth_emul_regime;
-                target->eth_enabled_num         = source->eth_enabled_num;
-
-                if(!flags->noinitrd)
-                {
-                    target->nvram_dump_offset = 6;
-                    void *nvbuf = ((char *)target) - (512 * target->nvram_dump_offset);
-                    FILE *fn = fopen(nvram, "r");
-                    if (fn == NULL) cancel(C_NVRAM_OPEN, "Can't open NVRAM image %s: %s\n", nvram, strerror(errno));
-                    size_t fns;
-                    if (fseek(fn, 0, SEEK_END) != 0) { fclose(fn); cancel(C_NVRAM_SEEK, "Can't seek NVRAM image: %s\n", strerror(errno)); }
-                    if ((fns = ftell(fn)) == -1) { fclose(fn); cancel(C_NVRAM_TELL, "Can't get NVRAM image position: %s\n", strerror(errno)); }
-                    rewind(fn);
-                    if ((fns <= 0) || (fns > 768)) { fclose(fn); cancel(C_NVRAM_SIZE, "NVRAM image must have size of 1 to 768 bytes.\n"); }
-                    printf("Loading NVRAM image from %s (%lu bytes):\n", nvram, fns);
-                    if (fread(nvbuf, fns, 1, fn) != 1) { fclose(fn); cancel(C_NVRAM_READ, "Can't read %u bytes of NVRAM image, file might be truncated\n", fns); }
-                    printf("Loaded NVRAM image: %lu bytes at address %p (%d sectors before kexec_info at %p)\n", fns, nvbuf, target->nvram_dump_offset, target);
-                    if(fclose(fn)) cancel(C_NVRAM_CLOSE, "Can't close NVRAM image\n");
-                }
-                break;
+        pthread_mutex_unlock(&buffers_lock);
+        if (buf->locked) munlock(buf->addr, buf->size);
+        if (buf->mapped) munmap(buf->addr, buf->size);
+        else free(buf->addr);
+        cancel(C_FILE_ALLOC, "Too many image buffers allocated\n");
+    }
+    buffers[buffers_num++] = *buf;
+    pthread_mutex_unlock(&buffers_lock);
+}
 
-            default:
-                printf("Kexec jumper contains kexec_info structure of unsupported version, so NVRAM image, boot disk, VGA card and trusted mode won't be passed to lintel.\n");
-        }
+static void read_image(struct lintelops *l, size_t realsize, void **out_buf, u64 *out_size, const char *what)
+{
+    *out_size = realsize; /* Note: this should EXACTLY match the lintel binary size, because it is used to calculate jump address (mcstbug#133402 comment 38) */
+    size_t aligned_size = realsize + alignment; aligned_size -= aligned_size % alignment;
+    struct buffer_t buf;
+    const char *huge = NULL;
+    if (use_hugepages && realsize >= huge_threshold && (huge = alloc_huge(aligned_size, &buf)))
+    {
+        /* Large images are read into huge pages rather than mapped, so TLB misses don't slow down kexec copying them */
+        *out_buf = buf.addr;
+        if (l->fread(l, *out_buf, *out_size, 1) != 1) { munmap(buf.addr, buf.size); *out_buf = NULL; l->fclose(l); cancel(C_FILE_READ, "Can't read %ld bytes for %s file, file might be truncated\n", *out_size, what); }
+        printf("Loaded %s into %s huge pages: %ld bytes at address %p (%ld bytes mapped)\n", what, huge, *out_size, *out_buf, buf.size);
+    }
+    else if (l->fclaim && l->fclaim(l, realsize, &buf) == 0)
+    {
+        *out_buf = buf.addr;
+        printf("%s %s: %ld bytes at address %p (%ld bytes aligned at 0x%lx)\n", buf.mapped ? "Mapped" : "Loaded", what, *out_size, *out_buf, buf.size, alignment);
+    }
+    else
+    {
+        if (posix_memalign(out_buf, alignment, aligned_size)) { l->fclose(l); cancel(C_FILE_ALLOC, "Can't allocate %ld bytes for %s file of %ld bytes\n", aligned_size, what, *out_size); }
+        buf.addr = *out_buf;
+        buf.size = aligned_size;
+        buf.mapped = 0;
+        buf.locked = 0;
+        if (l->fread(l, *out_buf, *out_size, 1) != 1) { free(*out_buf); *out_buf = NULL; l->fclose(l); cancel(C_FILE_READ, "Can't read %ld bytes for %s file, file might be truncated\n", *out_size, what); }
+        printf("Loaded %s: %ld bytes at address %p (%ld bytes aligned at 0x%lx)\n", what, *out_size, *out_buf, aligned_size, alignment);
     }
-    else printf("Kexec jumper does not contain kexec_info structure, so NVRAM image, boot disk, VGA card and trusted mode won't be passed to lintel.\n");
+    add_buffer(&buf);
+    if(l->fclose(l)) cancel(C_FILE_CLOSE, "Can't close %s file\n", what);
 }
 
-static void load_bcd_lintel(struct lintelops *l, FILE *f, const struct xrt_BcdHeader_t header, const struct kexec_info_t *kexec_info, const char *nvram, struct flags_t *flags)
+struct elf_extent_t
 {
-    printf ("File is BCD container (%d files).\n", header.files_num);
+    size_t start;
+    size_t end;
+    size_t dst;  /* offset in stripped image */
+};
+
+static int compare_extents(const void *a, const void *b)
+{
+    const struct elf_extent_t *x = a, *y = b;
+    return (x->start > y->start) - (x->start < y->start);
+}
+
+static int read_elf_kernel(struct lintelops *l, size_t realsize)
+{
+    /* Only ELF and program headers and PT_LOAD segments are read, page by page as they lie in the file; section headers and
+       everything else (debug info, symbols) are left out. Returns -1 with file rewound if it should be loaded as is */
+    Elf64_Ehdr eh;
+    const char *why = NULL;
+    if (realsize < sizeof(eh) || l->fread(l, &eh, sizeof(eh), 1) != 1 || memcmp(eh.e_ident, ELFMAG, SELFMAG)) why = "not an ELF file";
+    else if (eh.e_ident[EI_CLASS] != ELFCLASS64 || eh.e_ident[EI_DATA] != (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ ? ELFDATA2LSB : ELFDATA2MSB)) why = "not a native 64-bit ELF file";
+    else if (eh.e_phentsize != sizeof(Elf64_Phdr) || eh.e_phnum == 0 || eh.e_phoff % 8 || eh.e_phoff > realsize || eh.e_phnum * sizeof(Elf64_Phdr) > realsize - eh.e_phoff) why = "malformed program header table";
+
+    Elf64_Phdr *ph = NULL;
+    struct elf_extent_t *ext = NULL;
+    if (why == NULL && ((ph = malloc(eh.e_phnum * sizeof(*ph))) == NULL || (ext = malloc((eh.e_phnum + 1) * sizeof(*ext))) == NULL)) why = "no memory for program headers";
+    if (why == NULL && (l->fseek(l, eh.e_phoff, SEEK_SET) || l->fread(l, ph, sizeof(*ph), eh.e_phnum) != eh.e_phnum)) why = "can't read program headers";
+
+    /* Headers and segments are widened to whole pages, so that every byte keeps its offset within a page */
+    int ext_num = 0, loads = 0;
+    if (why == NULL)
+    {
+        ext[ext_num++] = (struct elf_extent_t){ 0, eh.e_phoff + eh.e_phnum * sizeof(*ph), 0 };
+        for (int i = 0; i < eh.e_phnum && why == NULL; ++i)
+        {
+            if (ph[i].p_type != PT_LOAD) continue;
+            ++loads;
+            if (ph[i].p_filesz == 0) continue;
+            if (ph[i].p_offset > realsize || ph[i].p_filesz > realsize - ph[i].p_offset) why = "loadable segment beyond end of file";
+            else ext[ext_num++] = (struct elf_extent_t){ ph[i].p_offset, ph[i].p_offset + ph[i].p_filesz, 0 };
+        }
+        if (why == NULL && loads == 0) why = "no loadable segments";
+    }
+    if (why)
+    {
+        printf("Kernel image is loaded as is: %s.\n", why);
+        free(ph);
+        free(ext);
+        l->rewind(l);
+        return -1;
+    }
+
+    qsort(ext, ext_num, sizeof(*ext), compare_extents);
+    int merged = 0;
+    for (int i = 0; i < ext_num; ++i)
+    {
+        size_t start = ext[i].start - ext[i].start % alignment, end = (ext[i].end + alignment - 1) / alignment * alignment;
+        if (end > realsize) end = realsize;
+        if (merged && start <= ext[merged - 1].end) { if (end > ext[merged - 1].end) ext[merged - 1].end = end; continue; }
+        ext[merged++] = (struct elf_extent_t){ start, end, 0 };
+    }
+    size_t size = 0;
+    for (int i = 0; i < merged; ++i) { ext[i].dst = size; size += ext[i].end - ext[i].start; }
+
+    size_t aligned_size = size + alignment; aligned_size -= aligned_size % alignment;
+    struct buffer_t buf;
+    if (posix_memalign(&buf.addr, alignment, aligned_size)) { free(ph); free(ext); l->fclose(l); cancel(C_FILE_ALLOC, "Can't allocate %ld bytes for stripped kernel of %ld bytes\n", aligned_size, size); }
+    buf.size = aligned_size;
+    buf.mapped = 0;
+    buf.locked = 0;
+    memset((char *)buf.addr + size, 0, aligned_size - size);
+    for (int i = 0; i < merged; ++i)
+    {
+        size_t len = ext[i].end - ext[i].start;
+        if (l->fseek(l, ext[i].start, SEEK_SET) || l->fread(l, (char *)buf.addr + ext[i].dst, len, 1) != 1)
+        {
+            free(buf.addr); free(ph); free(ext); l->fclose(l);
+            cancel(C_FILE_READ, "Can't read %ld bytes at offset %ld of kernel file, file might be truncated\n", len, ext[i].start);
+        }
+    }
+
+    /* Program headers that point to data left out are dropped; the rest are moved along with their data */
+    int kept = 0;
+    for (int i = 0; i < eh.e_phnum; ++i)
+    {
+        int j = 0;
+        while (j < merged && !(ph[i].p_offset >= ext[j].start && ph[i].p_offset <= ext[j].end && ph[i].p_filesz <= ext[j].end - ph[i].p_offset)) ++j;
+        if (j == merged && ph[i].p_filesz) continue;
+        ph[i].p_offset = (j == merged) ? size : ph[i].p_offset - ext[j].start + ext[j].dst;
+        ph[kept++] = ph[i];
+    }
+    eh.e_phnum = kept;
+    eh.e_shoff = 0;
+    eh.e_shnum = 0;
+    eh.e_shstrndx = SHN_UNDEF;
+    memcpy(buf.addr, &eh, sizeof(eh));
+    memcpy((char *)buf.addr + eh.e_phoff, ph, kept * sizeof(*ph));
+
+    kernel.image = buf.addr;
+    kernel.image_size = size;
+    add_buffer(&buf);
+    free(ph);
+    free(ext);
+    if (l->fclose(l)) cancel(C_FILE_CLOSE, "Can't close kernel file\n");
+    printf("Loaded stripped ELF kernel: %ld of %ld bytes (%d loadable segments in %d pieces), %ld bytes (%.1f%%) saved, at address %p\n",
+           size, realsize, loads, merged, realsize - size, realsize ? (realsize - size) * 100.0 / realsize : 0.0, buf.addr);
+    return 0;
+}
+
+static struct xrt_BcdHeader_t bcd_check_files(struct lintelops *l)
+{
+    if (l->fseek(l, l->base + 512, SEEK_SET) != 0) { l->fclose(l); cancel(C_BCD_SEEK, "Can't seek to possible header of file: %s\n", strerror(errno)); }
+    struct xrt_BcdHeader_t header;
+    if (l->fread(l, &header, sizeof(header), 1) != 1) { l->fclose(l); cancel(C_BCD_HEADER, "Can't read header of lintel file, file might be truncated\n"); }
+    if (header.signature != LINTEL_BCD_SIGNATURE) header.files_num = -1;
+    return header;
+}
+
+static void patch_jumper_info(const struct xrt_BcdFile_t super_file)
+{
+    printf("BCD file contains kexec jumper, patching the header.\n");
+
+    struct xrt_BcdHeader_t *subheader = (struct xrt_BcdHeader_t*)((char*)lintel.image + (super_file.init_size - 1) * 512); /* BCD map should be located in the last sector of lintel file */
+    if (subheader->signature != LINTEL_BCD_SIGNATURE) cancel(C_SUPER_HEADER, "Can't find BCD signature in super file\n");
+    struct xrt_BcdFile_t *files = (struct xrt_BcdFile_t*)((char*)subheader + sizeof(struct xrt_BcdHeader_t));
+    for (uint32_t i = 0; i < subheader->files_num; ++i)
+    {
+        if ( files[i].tag == PRIORITY_TAG_KEXEC_JUMPER )
+        {
+            files[i].lba = super_file.lba;
+            files[i].size = super_file.size;
+            return;
+        }
+    }
+    cancel(C_SUPER_JUMPER, "Can't find kexec jumper in super file\n");
+}
+
+static struct kexec_info_t *find_kexec_info(struct kexec_info_t *target)
+{
+    if (target->signature != 0x61746164)
+    {
+        printf("Kexec jumper does not contain kexec_info structure, so NVRAM image, boot disk, VGA card and trusted mode won't be passed to lintel.\n");
+        return NULL;
+    }
+    if (target->version != 0x01000000)
+    {
+        printf("Kexec jumper contains kexec_info structure of unsupported version, so NVRAM image, boot disk, VGA card and trusted mode won't be passed to lintel.\n");
+        return NULL;
+    }
+    return target;
+}
+
+static void load_nvram(const struct kexec_info_t *target, const char *nvram)
+{
+    /* NVRAM image does not depend on anything detected at runtime, so it is loaded together with the image itself */
+    void *nvbuf = ((char *)target) - (512 * NVRAM_DUMP_OFFSET);
+    FILE *fn = fopen(nvram, "r");
+    if (fn == NULL) cancel(C_NVRAM_OPEN, "Can't open NVRAM image %s: %s\n", nvram, strerror(errno));
+    size_t fns;
+    if (fseek(fn, 0, SEEK_END) != 0) { fclose(fn); cancel(C_NVRAM_SEEK, "Can't seek NVRAM image: %s\n", strerror(errno)); }
+    if ((fns = ftell(fn)) == -1) { fclose(fn); cancel(C_NVRAM_TELL, "Can't get NVRAM image position: %s\n", strerror(errno)); }
+    rewind(fn);
+    if ((fns <= 0) || (fns > 768)) { fclose(fn); cancel(C_NVRAM_SIZE, "NVRAM image must have size of 1 to 768 bytes.\n"); }
+    printf("Loading NVRAM image from %s (%lu bytes):\n", nvram, fns);
+    if (fread(nvbuf, fns, 1, fn) != 1) { fclose(fn); cancel(C_NVRAM_READ, "Can't read %u bytes of NVRAM image, file might be truncated\n", fns); }
+    printf("Loaded NVRAM image: %lu bytes at address %p (%d sectors before kexec_info at %p)\n", fns, nvbuf, NVRAM_DUMP_OFFSET, target);
+    if(fclose(fn)) cancel(C_NVRAM_CLOSE, "Can't close NVRAM image\n");
+}
+
+static void inject_kexec_info(const struct kexec_info_t *source, struct kexec_info_t *target, const struct flags_t *flags)
+{
+    memset(&(((uint32_t*)target)[3]), 0xff, target->size - 3 * sizeof(uint32_t));
+    target->interactive             = source->interactive;
+    target->boot_disk_pci_addr_node = source->boot_disk_pci_addr_node;
+    target->boot_disk_pci_addr_bus  = source->boot_disk_pci_addr_bus;
+    target->boot_disk_pci_addr_slot = source->boot_disk_pci_addr_slot;
+    target->boot_disk_pci_addr_func = source->boot_disk_pci_addr_func;
+    target->boot_disk_sata_port     = source->boot_disk_sata_port;
+    target->vga_pci_addr_node       = source->vga_pci_addr_node;
+    target->vga_pci_addr_bus        = source->vga_pci_addr_bus;
+    target->vga_pci_addr_slot       = source->vga_pci_addr_slot;
+    target->vga_pci_addr_func       = source->vga_pci_addr_func;
+    target->eth_emul_regime         = source->eth_emul_regime;
+    target->eth_enabled_num         = source->eth_enabled_num;
+    if(!flags->noinitrd) target->nvram_dump_offset = NVRAM_DUMP_OFFSET;
+}
+
+static void load_bcd_lintel(struct lintelops *l, const struct xrt_BcdHeader_t header, const char *nvram, struct flags_t *flags)
+{
+    printf ("File is BCD container (%d files).\n", header.files_num);
 
     struct xrt_BcdFile_t super_file = {0, 0, 0, 0, 0};
+
+    /* Whole file table is read at once, it directly follows the header */
+    if (header.files_num > MAX_BCD_FILES) { l->fclose(l); cancel(C_BCD_FILEHEADER, "BCD file claims to contain %u files, file is probably corrupted\n", header.files_num); }
+    struct xrt_BcdFile_t *files = malloc(header.files_num * sizeof(struct xrt_BcdFile_t) + 1);
+    if (files == NULL) { l->fclose(l); cancel(C_BCD_FILEHEADER, "Can't allocate memory for file table of BCD file\n"); }
+    if (header.files_num && l->fread(l, files, sizeof(struct xrt_BcdFile_t), header.files_num) != header.files_num) { free(files); l->fclose(l); cancel(C_BCD_FILEHEADER, "Can't read file table of BCD file, file might be truncated\n"); }
     for (uint32_t i = 0; i < header.files_num; ++i)
     {
-        struct xrt_BcdFile_t file;
-        if (l->fread(&file, sizeof(file), 1, f) != 1) { l->fclose(f); cancel(C_BCD_FILEHEADER, "Can't read file %d header of BCD file, file might be truncated\n"); }
+        struct xrt_BcdFile_t file = files[i];
         printf("BCD file %d: /%d, offset %ld blocks, size %ld blocks, init_size %ld blocks, checksum 0x%08x\n", i, file.tag, file.lba, file.size, file.init_size, file.checksum);
 
         if (file.tag == PRIORITY_TAG_LINTEL)
         {
-            if (i != 0) { l->fclose(f); cancel(C_BCD_ORDER, "Lintel file must be the first one in BCD\n"); }
-            if (file.size > file.init_size) { l->fclose(f); cancel(C_BCD_READ, "Can't read lintel file from BCD file: file is uninitialized\n"); }
+            if (i != 0) { free(files); l->fclose(l); cancel(C_BCD_ORDER, "Lintel file must be the first one in BCD\n"); }
+            if (file.size > file.init_size) { free(files); l->fclose(l); cancel(C_BCD_READ, "Can't read lintel file from BCD file: file is uninitialized\n"); }
             super_file.tag = file.tag;
             super_file.lba = file.lba;
             super_file.init_size = file.size; /* Save for future patching in case of kexec jumper exists */
@@ -787,6 +1751,10 @@ static void load_bcd_lintel(struct lintelops *l, FILE *f, const struct xrt_BcdHe
         }
         if (file.tag == PRIORITY_TAG_KEXEC_JUMPER)
         {
+            /* Lintel and kexec jumper are loaded as one image up to the first free block, so both must lie below it */
+            if (!super_file.size || (super_file.init_size > header.free_lba) || (super_file.lba > header.free_lba - super_file.init_size) ||
+                (file.lba < super_file.lba) || (file.size > header.free_lba) || (file.lba > header.free_lba - file.size))
+            { free(files); l->fclose(l); cancel(C_BCD_LAYOUT, "Lintel and kexec jumper don't lie below first free block %lu of BCD file, file is probably corrupted\n", header.free_lba); }
             super_file.tag = file.tag;
             super_file.size = header.free_lba - super_file.lba;
             if ((file.size < 7) && !flags->noinitrd)
@@ -797,14 +1765,16 @@ static void load_bcd_lintel(struct lintelops *l, FILE *f, const struct xrt_BcdHe
             break;
         }
     }
-    if (!super_file.size) { l->fclose(f); cancel(C_BCD_NOTFOUND, "Can't find lintel file in BCD file\n"); }
+    free(files);
+    if (!super_file.size) { l->fclose(l); cancel(C_BCD_NOTFOUND, "Can't find lintel file in BCD file\n"); }
 
-    if (l->fseek(f, 512 * super_file.lba, SEEK_SET) != 0) { l->fclose(f); cancel(C_BCD_SEEK, "Can't seek to start of lintel binary in BCD file: %s\n", strerror(errno)); }
-    read_image(l, f, 512 * super_file.size, &lintel.image, &lintel.image_size, "BCD file");
+    if (l->fseek(l, l->base + 512 * super_file.lba, SEEK_SET) != 0) { l->fclose(l); cancel(C_BCD_SEEK, "Can't seek to start of lintel binary in BCD file: %s\n", strerror(errno)); }
+    read_image(l, 512 * super_file.size, &lintel.image, &lintel.image_size, "BCD file");
     if (super_file.tag == PRIORITY_TAG_KEXEC_JUMPER)
     {
         patch_jumper_info(super_file);
-        inject_kexec_info(kexec_info, (struct kexec_info_t *)(lintel.image + 512 * (super_file.size - 1)), nvram, flags);
+        jumper_info = find_kexec_info((struct kexec_info_t *)(lintel.image + 512 * (super_file.size - 1)));
+        if (jumper_info && !flags->noinitrd) load_nvram(jumper_info, nvram);
     }
     else
     {
@@ -812,28 +1782,101 @@ static void load_bcd_lintel(struct lintelops *l, FILE *f, const struct xrt_BcdHe
     }
 }
 
-size_t stdin_fread(void *ptr, size_t size, size_t nmemb, FILE *stream)
+static int stdin_resize(struct lintelops *l, size_t newalloc)
+{
+    char *newcache;
+    if (posix_memalign((void**)&newcache, alignment, newalloc)) return -1;
+    if (l->cachesize) memcpy(newcache, l->cache, l->cachesize);
+    free(l->cache);
+    l->cache = newcache;
+    l->cachealloc = newalloc;
+    return 0;
+}
+
+static int stdin_grow(struct lintelops *l, size_t size)
+{
+    /* Grow geometrically into aligned buffers, so a fully cached stream can be handed over as an image buffer as is */
+    if (l->cachealloc >= size) return 0;
+    size_t newalloc = l->cachealloc ? l->cachealloc : alignment;
+    while (newalloc < size) newalloc *= 2;
+    return stdin_resize(l, newalloc);
+}
+
+static size_t stdin_pending(struct lintelops *l)
+{
+    /* Bytes yet to come, as far as known: the rest of a redirected file, or what a pipe holds already */
+    if (l->src == NULL) return 0;
+    int fd = fileno(l->src), n;
+    struct stat st;
+    off_t pos;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (pos = ftello(l->src)) != -1) return (st.st_size > pos) ? st.st_size - pos : 0;
+    if (ioctl(fd, FIONREAD, &n) == 0 && n > 0) return n;
+    return 0;
+}
+
+static size_t stdin_src_read(struct lintelops *l, void *ptr, size_t size)
+{
+    return l->src ? fread(ptr, 1, size, l->src) : 0;
+}
+
+static size_t stdin_skip(struct lintelops *l, size_t size)
+{
+    char scratch[65536];
+    size_t skipped = 0;
+    while (skipped < size)
+    {
+        size_t chunk = size - skipped > sizeof(scratch) ? sizeof(scratch) : size - skipped;
+        size_t r = stdin_src_read(l, scratch, chunk);
+        skipped += r;
+        if (r < chunk) break;
+    }
+    l->streampos += skipped;
+    return skipped;
+}
+
+size_t stdin_fread(struct lintelops *l, void *ptr, size_t size, size_t nmemb)
 {
-    struct lintelops* l = (struct lintelops*)stream;
     size_t actual_bytes = size * nmemb;
-    size_t newcachesize = l->fptr + actual_bytes;
-    if (l->cachesize < newcachesize)
+    size_t done = 0;
+
+    if (l->fptr < l->cachesize)
+    {
+        done = l->cachesize - l->fptr;
+        if (done > actual_bytes) done = actual_bytes;
+        if (ptr) memcpy(ptr, l->cache + l->fptr, done);
+        l->fptr += done;
+    }
+    if (done == actual_bytes) return nmemb;
+    if (l->fptr < l->streampos) { errno = ESPIPE; return done / size; } /* Already passed by without caching */
+
+    if (l->streampos == l->cachesize && (ptr == NULL || actual_bytes - done <= STDIN_CACHE_LIMIT))
+    {
+        /* Small reads (headers, file table) are cached together with anything skipped before them, so we may still seek back */
+        size_t newcachesize = l->fptr + actual_bytes - done;
+        if (stdin_grow(l, newcachesize)) return done / size;
+        size_t r = stdin_src_read(l, l->cache + l->cachesize, newcachesize - l->cachesize);
+        l->cachesize += r;
+        l->streampos += r;
+        if (l->cachesize <= l->fptr) return done / size;
+        size_t n = l->cachesize - l->fptr;
+        if (ptr) memcpy((char*)ptr + done, l->cache + l->fptr, n);
+        l->fptr += n;
+        done += n;
+    }
+    else
     {
-        char *newcache = realloc(l->cache, newcachesize);
-        if(!newcache) return 0;
-        l->cache = newcache;
-        l->cachesize += fread(l->cache + l->cachesize, 1, newcachesize - l->cachesize, stdin);
-        if(l->cachesize < l->fptr) return 0;
-        actual_bytes = l->cachesize - l->fptr;
+        /* Bulk reads go straight to the destination; the stream can't be rewound past this point anymore */
+        if (stdin_skip(l, l->fptr - l->streampos) < l->fptr - l->streampos) return done / size;
+        size_t r = ptr ? stdin_src_read(l, (char*)ptr + done, actual_bytes - done) : stdin_skip(l, actual_bytes - done);
+        if (ptr) l->streampos += r;
+        l->fptr += r;
+        done += r;
     }
-    if(ptr && actual_bytes) memcpy(ptr, l->cache + l->fptr, actual_bytes);
-    l->fptr += actual_bytes;
-    return actual_bytes / size;
+    return done / size;
 }
 
-int stdin_fseek(FILE *stream, long offset, int whence)
+int stdin_fseek(struct lintelops *l, long offset, int whence)
 {
-    struct lintelops *l = (struct lintelops*)stream;
     switch(whence)
     {
         case SEEK_SET:
@@ -847,8 +1890,21 @@ int stdin_fseek(FILE *stream, long offset, int whence)
             break;
 
         case SEEK_END:
-            /* Read by 4k blocks till the end to determine size */
-            while (l->fread(NULL, 4096, 1, stream) > 0);
+            /* Cache everything till the end to determine size. Known size is allocated at once, with the slack read_image() would add,
+               so the cache is handed over without copying; anything beyond it doubles the buffer, which keeps this linear */
+            if (l->streampos != l->cachesize) { errno = ESPIPE; return -1; }
+            size_t expect = l->cachesize + stdin_pending(l) + alignment; expect -= expect % alignment;
+            if (expect > l->cachealloc && stdin_resize(l, expect)) { errno = ENOMEM; return -1; }
+            for (;;)
+            {
+                if (l->cachesize == l->cachealloc && stdin_grow(l, l->cachealloc * 2 + 1)) { errno = ENOMEM; return -1; }
+                size_t r = stdin_src_read(l, l->cache + l->cachesize, l->cachealloc - l->cachesize);
+                l->cachesize += r;
+                l->streampos += r;
+                if (r == 0) break;
+            }
+            if (l->src && ferror(l->src)) { errno = EIO; return -1; }
+            l->fptr = l->cachesize + offset;
             break;
 
         default:
@@ -857,231 +1913,2231 @@ int stdin_fseek(FILE *stream, long offset, int whence)
     return 0;
 }
 
-long stdin_ftell(FILE *stream)
+long stdin_ftell(struct lintelops *l)
 {
-    return ((struct lintelops*)stream)->fptr;
+    return l->fptr;
 }
 
-void stdin_rewind(FILE *stream)
+void stdin_rewind(struct lintelops *l)
 {
-    ((struct lintelops*)stream)->fptr = 0;
+    l->fptr = 0;
 }
 
-int stdin_fclose(FILE *stream)
+int stdin_fclose(struct lintelops *l)
 {
     /* After fclose(), next reads from stdin would perform as if a new file was opened */
-    free(((struct lintelops*)stream)->cache);
-    ((struct lintelops*)stream)->cachesize = 0;
-    ((struct lintelops*)stream)->cache = NULL;
-    ((struct lintelops*)stream)->fptr = 0;
+    free(l->cache);
+    l->cachesize = 0;
+    l->cachealloc = 0;
+    l->cache = NULL;
+    l->fptr = 0;
+    l->streampos = 0;
+    /* Non-seekable files read through the cache are closed along with it */
+    if (l->src && l->src != stdin) fclose(l->src);
+    l->src = NULL;
     return 0;
 }
 
-size_t get_fsize(struct lintelops *l, FILE *f)
+int stdin_fclaim(struct lintelops *l, size_t size, struct buffer_t *buf)
 {
-    size_t r;
-    if (l->fseek(f, 0, SEEK_END) != 0) { l->fclose(f); cancel(C_FILE_SEEK, "Can't seek file: %s\n", strerror(errno)); }
-    if ((r = l->ftell(f)) == -1) { l->fclose(f); cancel(C_FILE_TELL, "Can't get file position: %s\n", strerror(errno)); }
-    l->rewind(f);
-    return r;
+    /* If the whole image is already cached from the very start, the cache itself becomes the image buffer */
+    size_t aligned_size = size + alignment; aligned_size -= aligned_size % alignment;
+    if (l->fptr != 0 || l->cachesize < size || l->cachealloc < aligned_size) return -1;
+
+    buf->addr = l->cache;
+    buf->size = l->cachealloc;
+    buf->mapped = 0;
+    buf->locked = 0;
+    l->cache = NULL;
+    l->cachesize = 0;
+    l->cachealloc = 0;
+    l->streampos = 0;
+    return 0;
 }
 
-static void load_image(const char *fname, const char *initrd, const char *cmdline, struct flags_t *flags, const struct kexec_info_t *kexec_info)
+static void reader_stream(struct lintelops *l, FILE *src)
 {
-    FILE *f;
-    struct lintelops l = { NULL, 0, 0, fread, fseek, ftell, rewind, fclose };
-    if(strcmp(fname, "-"))
+    /* Standard input, pipes and such can't be rewound, so whatever is read from them is cached until it is known to be needed no more */
+    struct lintelops s = { NULL, 0, 0, 0, 0, src, stdin_fread, stdin_fseek, stdin_ftell, stdin_rewind, stdin_fclose, stdin_fclaim, -1, 0, 0, 0, NULL };
+    *l = s;
+}
+
+int fd_fclaim(struct lintelops *l, size_t size, struct buffer_t *buf)
+{
+    /* Regular files are mapped privately instead of being read, so only pages patched afterwards get copied */
+    struct stat st;
+    long pagesize = sysconf(_SC_PAGESIZE);
+    off_t offset = l->fptr;
+    if (pagesize <= 0 || fstat(l->fd, &st) == -1 || !S_ISREG(st.st_mode)) return -1;
+    if (size == 0 || offset % pagesize || offset % alignment || offset + size > st.st_size) return -1;
+
+    /* Populate read-only first: prefaulting a writable private mapping would break COW on every page */
+    size_t mapsize = (size + pagesize - 1) / pagesize * pagesize; /* tail of the last page reads as zeroes */
+    void *p = mmap(NULL, mapsize, PROT_READ, MAP_PRIVATE | MAP_POPULATE, l->fd, offset);
+    if (p == MAP_FAILED) return -1;
+    madvise(p, mapsize, MADV_SEQUENTIAL);
+    madvise(p, mapsize, MADV_WILLNEED);
+    buf->addr = p;
+    buf->size = mapsize;
+    buf->mapped = 1;
+    buf->locked = 0;
+    lock_buffer(buf);
+    if (mprotect(p, mapsize, PROT_READ | PROT_WRITE))
     {
-        /* May be undefined in non-POSIX environments; then we don't expand tilde. */
-        #ifndef GLOB_TILDE
-            #define GLOB_TILDE 0
-        #endif
+        if (buf->locked) munlock(p, mapsize);
+        munmap(p, mapsize);
+        return -1;
+    }
+    l->fptr += size;
+    return 0;
+}
 
-        printf("Requested image path: %s\n", fname);
-        glob_t globbuf;
-        switch(glob(fname, GLOB_ERR | GLOB_TILDE, NULL, &globbuf))
-        {
-            case 0:
-                if (globbuf.gl_pathc != 1)
-                {
-                    globfree(&globbuf);
-                    cancel(C_GLOB_AMBIG, "Ambiguous pattern %s matching %d files\n", fname, globbuf.gl_pathc);
-                }
-                break;
+size_t get_fsize(struct lintelops *l)
+{
+    size_t r;
+    if (l->fseek(l, 0, SEEK_END) != 0) { l->fclose(l); cancel(C_FILE_SEEK, "Can't seek file: %s\n", strerror(errno)); }
+    if ((r = l->ftell(l)) == -1) { l->fclose(l); cancel(C_FILE_TELL, "Can't get file position: %s\n", strerror(errno)); }
+    l->rewind(l);
+    return r;
+}
 
-            case GLOB_NOSPACE:
-                globfree(&globbuf);
-                cancel(C_GLOB_ALLOC, "No memory globbing %s\n", fname);
+#define DIRECT_BOUNCE (1 << 20)
+#define READ_AHEAD 65536 /* Bounce reads are at least this large, so header and file table come from a single read */
+#define URING_CHUNK (1 << 20)
 
-            case GLOB_ABORTED:
-                globfree(&globbuf);
-                cancel(C_GLOB_ABORT, "Read error while globbing %s\n", fname);
+static int direct_fallback(struct lintelops *l)
+{
+    /* Called when direct read fails with EINVAL: retry with page alignment, then give up on direct I/O */
+    if (l->dio_align == 1) return -1;
+    if (l->dio_align < alignment) { l->dio_align = alignment; return 0; }
+    int fl = fcntl(l->fd, F_GETFL);
+    if (fl == -1 || fcntl(l->fd, F_SETFL, fl & ~O_DIRECT) == -1) return -1;
+    printf("Direct I/O is not possible here, reading file through page cache.\n");
+    l->dio_align = 1;
+    return 0;
+}
 
-            case GLOB_NOMATCH:
-                globfree(&globbuf);
-                cancel(C_GLOB_NONE, "No files found matching %s\n", fname);
+static ssize_t fd_pread(int fd, void *buf, size_t size, off_t offset)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t r = pread(fd, (char*)buf + done, size - done, offset + done);
+        if (r == -1 && errno == EINTR) continue;
+        if (r == -1) return -1;
+        if (r == 0) break;
+        done += r;
+    }
+    return done;
+}
 
-            default:
-                globfree(&globbuf);
-                cancel(C_GLOB_UNEXPECTED, "Unexpected error globbing %s, internal result: %s\n", fname, strerror(errno));
-        }
+#ifdef USE_IO_URING
+struct uring_slot_t
+{
+    struct iovec iov;
+    off_t offset;
+};
 
-        f = fopen(globbuf.gl_pathv[0],"r");
-        if (f == NULL) { globfree(&globbuf); cancel(C_FILE_OPEN_IMAGE, "Can't open image file %s: %s\n", fname, strerror(errno)); }
-        printf("Loading image from %s:\n", globbuf.gl_pathv[0]);
-        globfree(&globbuf);
-    }
-    else
+struct uring_t
+{
+    int fd;             /* -1 if io_uring turned out to be unavailable, so that it is not tried again */
+    unsigned depth;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    struct uring_slot_t *slots;
+    unsigned *free_slots;
+};
+
+static void uring_close(struct uring_t *r)
+{
+    if (r->sqes) munmap(r->sqes, r->sqes_size);
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_size);
+    if (r->sq_ptr) munmap(r->sq_ptr, r->sq_size);
+    if (r->fd != -1) close(r->fd);
+    free(r->slots);
+    free(r->free_slots);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+static struct uring_t *uring_open(unsigned depth)
+{
+    /* liburing is not required: the ring is set up with raw system calls, as only one kind of request is ever made */
+    struct uring_t *r = calloc(1, sizeof(*r));
+    if (r == NULL) return NULL;
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, depth, &p);
+    if (r->fd == -1) goto fail;
+    r->depth = depth;
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
     {
-        printf("Piping image from standard input\n");
-        f = (FILE*)&l;
-        l.fread = stdin_fread;
-        l.fseek = stdin_fseek;
-        l.ftell = stdin_ftell;
-        l.rewind = stdin_rewind;
-        l.fclose = stdin_fclose;
+        if (r->cq_size > r->sq_size) r->sq_size = r->cq_size;
+        r->cq_size = r->sq_size;
     }
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) { r->sq_ptr = NULL; goto fail; }
+    r->cq_ptr = (p.features & IORING_FEAT_SINGLE_MMAP) ? r->sq_ptr : mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_ptr == MAP_FAILED) { r->cq_ptr = NULL; goto fail; }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) { r->sqes = NULL; goto fail; }
+    r->sq_tail = (unsigned *)((char *)r->sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned *)((char *)r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)((char *)r->sq_ptr + p.sq_off.array);
+    r->cq_head = (unsigned *)((char *)r->cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)r->cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned *)((char *)r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_ptr + p.cq_off.cqes);
+
+    /* Every request in flight owns a slot, as its iovec must stay in place until the request is submitted */
+    r->slots = calloc(depth, sizeof(*r->slots));
+    r->free_slots = calloc(depth, sizeof(*r->free_slots));
+    if (r->slots == NULL || r->free_slots == NULL) { errno = ENOMEM; goto fail; }
+    printf("Reading file with io_uring, up to %u requests of %d KiB in flight.\n", depth, URING_CHUNK >> 10);
+    return r;
 
-    struct xrt_BcdHeader_t header = bcd_check_files(&l, f);
-    if (header.files_num == -1)
-    {
-        size_t realsize = get_fsize(&l, f);
+fail:
+    printf("io_uring is not available here (%s), reading file with pread().\n", strerror(errno));
+    uring_close(r);
+    return r;
+}
 
-        if(flags->iskernel)
-        {
-            printf ("File seems to be a kernel image.\n");
-            read_image(&l, f, realsize, &kernel.image, &kernel.image_size, "kernel");
+static ssize_t uring_read(struct uring_t *r, int fd, void *buf, size_t size, off_t offset)
+{
+    /* Same as pread() of the whole range, but with chunks of it read at once; completions come in any order */
+    size_t chunks = (size + URING_CHUNK - 1) / URING_CHUNK, next = 0, end = size;
+    unsigned inflight = 0, pending = 0, nfree = r->depth;
+    int err = 0;
+    for (unsigned i = 0; i < r->depth; ++i) r->free_slots[i] = i;
 
-            if(flags->noinitrd)
-            {
-                kernel.initrd_size = 0;
-            }
-            else
-            {
-                struct lintelops s = { NULL, 0, 0, fread, fseek, ftell, rewind, fclose };
-                FILE *fi = fopen(initrd,"r");
-                if (fi == NULL) cancel(C_LINUX_OPEN_INITRD, "Can't open initrd file %s: %s\n", initrd, strerror(errno));
-                realsize = get_fsize(&s, fi);
-                printf("Loading initrd from %s:\n", initrd);
-                read_image(&s, fi, realsize, &kernel.initrd, &kernel.initrd_size, "initrd");
-            }
+    while ((next < chunks && !err) || inflight || pending)
+    {
+        unsigned tail = *r->sq_tail, submit = 0;
+        while (next < chunks && !err && nfree)
+        {
+            unsigned slot = r->free_slots[--nfree];
+            size_t len = (next == chunks - 1) ? size - next * URING_CHUNK : URING_CHUNK;
+            r->slots[slot] = (struct uring_slot_t){ { (char *)buf + next * URING_CHUNK, len }, offset + next * URING_CHUNK };
+            unsigned idx = (tail + submit) & *r->sq_mask;
+            struct io_uring_sqe *sqe = &r->sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_READV;
+            sqe->fd = fd;
+            sqe->addr = (uintptr_t)&r->slots[slot].iov;
+            sqe->len = 1;
+            sqe->off = r->slots[slot].offset;
+            sqe->user_data = slot;
+            r->sq_array[idx] = idx;
+            ++submit;
+            ++next;
+        }
+        __atomic_store_n(r->sq_tail, tail + submit, __ATOMIC_RELEASE);
+        pending += submit;
 
-            char *oldcmdline = NULL;
-            if(flags->cmdline != 'c')
-            {
-                read_sysfs("/proc/cmdline", &oldcmdline, NULL);
-                *strchrnul(oldcmdline, '\n') = '\0';
-            }
-            if(((flags->cmdline == 'c') ? strlen(cmdline) : (strlen(oldcmdline) + ((flags->cmdline == 1) ? 0 : (strlen(cmdline) + 1)))) >= COMMAND_LINE_SIZE)
+        int n = syscall(__NR_io_uring_enter, r->fd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n == -1 && (errno == EINTR || errno == EAGAIN)) continue;
+        if (n == -1)
+        {
+            /* Ring itself is broken, not the file. Requests that made it to kernel still write into buf, so they are waited for
+               before the ring is dropped and caller falls back to pread(); if they can't be, ring is kept and the read just fails */
+            err = errno;
+            while (inflight)
             {
-                if (oldcmdline) free(oldcmdline);
-                cancel(C_LINUX_RESCMDLINE_LONG, "Command line to pass to kernel is longer than %d bytes\n", COMMAND_LINE_SIZE);
+                if (syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1 && errno != EINTR && errno != EAGAIN) break;
+                unsigned head = *r->cq_head, ctail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+                inflight -= ctail - head;
+                __atomic_store_n(r->cq_head, ctail, __ATOMIC_RELEASE);
             }
+            if (!inflight) uring_close(r);
+            errno = err;
+            return -1;
+        }
+        pending -= n;
+        inflight += n;
 
-            switch(flags->cmdline)
+        unsigned head = *r->cq_head, ctail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != ctail; ++head)
+        {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            unsigned slot = cqe->user_data;
+            struct uring_slot_t *s = &r->slots[slot];
+            size_t start = (char *)s->iov.iov_base - (char *)buf;
+            if (cqe->res < 0 && !err) err = -cqe->res;
+            else if (cqe->res >= 0 && (size_t)cqe->res < s->iov.iov_len)
             {
-                case 1:
-                    strcpy(kernel.cmdline, oldcmdline);
-                    break;
-                case 'a':
-                    strcpy(kernel.cmdline, oldcmdline);
-                    strcat(kernel.cmdline, " ");
-                    strcat(kernel.cmdline, cmdline);
-                    break;
-                case 'c':
-                    strcpy(kernel.cmdline, cmdline);
-                    break;
+                /* Short read is either end of file, or an interrupted one, which is finished synchronously */
+                ssize_t rest = cqe->res ? fd_pread(fd, (char *)s->iov.iov_base + cqe->res, s->iov.iov_len - cqe->res, s->offset + cqe->res) : 0;
+                if (rest == -1 && !err) err = errno;
+                if (rest != -1 && start + cqe->res + rest < end) end = start + cqe->res + rest;
             }
-            kernel.cmdline_size = strlen(kernel.cmdline);
-            printf("Kernel command line: %s\n", kernel.cmdline);
+            r->free_slots[nfree++] = slot;
+            --inflight;
         }
-        else
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    if (err) { errno = err; return -1; }
+    return end;
+}
+#endif
+
+static ssize_t fd_read_bulk(struct lintelops *l, void *buf, size_t size, off_t offset)
+{
+#ifdef USE_IO_URING
+    /* Large ranges are read by many requests at once: with a single one in flight, fast devices idle most of the time */
+    if (io_depth > 1 && size >= 2 * URING_CHUNK)
+    {
+        if (l->ring == NULL) l->ring = uring_open(io_depth);
+        if (l->ring && l->ring->fd != -1)
         {
-            printf ("File seems to be raw lintel image, so NVRAM image, boot disk, VGA card and trusted mode won't be passed.\n");
-            read_image(&l, f, realsize, &lintel.image, &lintel.image_size, "lintel");
+            ssize_t r = uring_read(l->ring, l->fd, buf, size, offset);
+            if (r != -1 || l->ring->fd != -1) return r;
+            printf("io_uring failed (%s), reading file with pread().\n", strerror(errno));
         }
     }
-    else
+#endif
+    return fd_pread(l->fd, buf, size, offset);
+}
+
+size_t fd_fread(struct lintelops *l, void *ptr, size_t size, size_t nmemb)
+{
+    /* Large aligned ranges are read right into destination; anything else, and unaligned head and tail, go through bounce buffer */
+    size_t want = size * nmemb, done = 0;
+    while (done < want)
     {
-        flags->iskernel = 0;
-        load_bcd_lintel(&l, f, header, kexec_info, initrd, flags);
+        size_t a = l->dio_align, pos = l->fptr, left = want - done;
+        char *dst = ptr ? (char*)ptr + done : NULL;
+        ssize_t r;
+        if (pos >= l->streampos && pos < l->streampos + l->cachesize)
+        {
+            /* Header and file table are read piece by piece, but come from a single bounce read */
+            r = l->streampos + l->cachesize - pos;
+            if (r > left) r = left;
+            if (dst) memcpy(dst, l->cache + (pos - l->streampos), r);
+        }
+        else if (dst && pos % a == 0 && (uintptr_t)dst % a == 0 && left >= a && left >= READ_AHEAD)
+        {
+            r = fd_read_bulk(l, dst, left - left % a, pos);
+            if (r == -1 && errno == EINVAL && direct_fallback(l) == 0) continue;
+            if (r == -1) break;
+        }
+        else
+        {
+            if (l->cache == NULL && posix_memalign((void**)&l->cache, alignment, DIRECT_BOUNCE)) { l->cache = NULL; errno = ENOMEM; break; }
+            size_t start = pos - pos % a;
+            size_t n = (pos - start + left + a - 1) / a * a;
+            if (n < READ_AHEAD) n = READ_AHEAD;
+            if (n > DIRECT_BOUNCE) n = DIRECT_BOUNCE;
+            l->cachesize = 0;
+            r = fd_pread(l->fd, l->cache, n, start);
+            if (r == -1 && errno == EINVAL && direct_fallback(l) == 0) continue;
+            if (r == -1) break;
+            l->streampos = start;
+            l->cachesize = r;
+            if (r <= pos - start) break;
+            continue;
+        }
+        if (r == 0) break;
+        l->fptr += r;
+        done += r;
     }
+    return done / size;
 }
 
-static int check_syslog(const char *marker)
+int fd_fseek(struct lintelops *l, long offset, int whence)
 {
-    char buf[1001];
-    memset(buf, 0, 1001);
-    int len = klogctl(3, buf, 1000);
-    return strstr(buf, marker) != NULL;
+    long base = (whence == SEEK_SET) ? 0 : (whence == SEEK_CUR) ? (long)l->fptr : (long)l->fsize;
+    if (base + offset < 0) { errno = EINVAL; return -1; }
+    l->fptr = base + offset;
+    return 0;
 }
 
-static void remount_filesystems()
+long fd_ftell(struct lintelops *l)
 {
-    write_sysfs("/proc/sys/kernel/printk","7\n");
-    write_sysfs("/proc/sysrq-trigger","u\n");
-    while(!check_syslog("Emergency Remount complete\n"));
+    return l->fptr;
 }
 
-extern const char *vcs_ver;
-static void version(const char *argv0)
+void fd_rewind(struct lintelops *l)
 {
-    printf("%s (kexec-e2k) version %s, git revision %s\n", argv0, PROJ_VER, vcs_ver);
-    exit(C_SUCCESS);
+    l->fptr = 0;
 }
 
-static void usage(const char *argv0, const char *def)
+int fd_fclose(struct lintelops *l)
 {
-    printf("Usage:\n");
-    printf("    %s [OPTIONS] [FILE]\n\n", argv0);
-    printf("    FILE:             File to start (may be a plain lintel starter or kernel image, lintel BCD image, or a lintel BCD image with kexec jumper)\n");
-    printf("                      Wildcards are supported (to prevent shell expansion, put the argument in quotes). Only one file should fit the pattern then.\n");
-    printf("                      If not specified, %s is loaded. Use a single dash to load a file from standard input\n", def);
-    printf("    OPTIONS:\n");
-    printf("        --version:    Show version and exit\n");
-    printf("        -h | --help:  Show this help and exit\n");
-    printf("        -t | --tty N: Reset framebuffer device associated with ttyN instead of currently active one (has no effect if -b, or both -M and -P are given)\n");
-    printf("        -e N:         Allow only N network adapters\n");
-    printf("        -E TYPE:      Set network adapter type to TYPE (supported types: `Intel', `PCNet', `Elbrus')\n");
-    printf("        -m:           Don't check for unmounted filesystems and don't mount them\n");
-    printf("        -i:           Ignored (for backwards compatibility)\n");
-    printf("        -r:           Don't check current runlevel\n");
-    printf("        -X:           Don't check if X is started\n");
-    printf("        -b:           Don't reset current framebuffer device\n");
-    printf("        -f:           Don't sync, flush, and remount-read-only filesystems\n");
-    printf("        -V:           Don't unbind currently active vtconsole (has no effect if -b is given)\n");
-    printf("        -M:           Don't unload module bound to PCI Express device implementing current framebuffer (has no effect if -b is given)\n");
-    printf("        -P:           Don't remove PCI Express device implementing current framebuffer (has no effect if -b is given)\n");
-    printf("        -B:           Ignored (for backwards compatibility)\n");
-    printf("        -x:           Don't perform actual kexec or kexec_lintel ioctl but everything preceeding it\n");
-    printf("When starting kernel image:\n");
-    printf("        -I FILE:      Use FILE as initrd image (no initrd image is passed if not specified)\n");
-    printf("        -c CMDLINE:   Pass CMDLINE as new kernel command line (one of currently loaded kernel is passed if neither -c nor -a specified)\n");
-    printf("        -a CMDLINE:   Add CMDLINE to one of currently loaded kernel to produce new kernel command line\n");
-    printf("When starting lintel image:\n");
-    printf("        -l:           Treat non-BCD file as a lintel starter, not kernel image\n");
-    printf("        -d DEVNAME:   Avoid asking for boot drive and boot guest OS from DEVNAME (e.g. /dev/sdc) by default\n");
-    printf("        -N FILE:      Use FILE as NVRAM image (if not specified, lintel will read actual NVRAM). Create it by calling dd if=/dev/nvram of=FILE bs=256 skip=1 count=3\n");
-    printf("        -T:           Prohibit lintel to react at any keypress to perform a controlled trusted boot (has an effect only if -d is given)\n");
-    printf("        -n:           Don't check that boot disk AHCI controller is on node 0 (has an effect only if -d is given)\n");
-    printf("        -v:           Don't pass current video adapter id to lintel and make it load on the one it has in NVRAM\n");
-    exit(C_SUCCESS);
+#ifdef USE_IO_URING
+    if (l->ring) { uring_close(l->ring); free(l->ring); }
+#endif
+    l->ring = NULL;
+    free(l->cache);
+    l->cache = NULL;
+    l->cachesize = 0;
+    int r = close(l->fd);
+    l->fd = -1;
+    return r;
 }
 
-static const char *check_args(int argc, char * const argv[], const char *def, int *tty, struct flags_t *flags, dev_t *disk, char cmdline[], char initrd[])
+static int reader_open(struct lintelops *l, const char *path, const char *what, const struct flags_t *flags)
 {
-    int is_nvram = 0;
-    for(;;)
+    /* Regular files and block devices are read at arbitrary offsets; anything else is read as a stream. Returns -1 and errno on failure */
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    off_t size = (fstat(fd, &st) == -1) ? -1 : S_ISBLK(st.st_mode) ? lseek(fd, 0, SEEK_END) : st.st_size;
+    if (size == -1) { int e = errno; close(fd); errno = e; return -1; }
+    if (!S_ISREG(st.st_mode) && !S_ISBLK(st.st_mode))
     {
-        int opt = getopt(argc, argv, "h-:t:d:I:N:c:a:e:E:TnmlirbfvVMPBXx");
-        if(opt == -1)
+        FILE *f = fdopen(fd, "r");
+        if (f == NULL) { int e = errno; close(fd); errno = e; return -1; }
+        reader_stream(l, f);
+        return 0;
+    }
+
+    struct lintelops r = { NULL, 0, 0, 0, 0, NULL, fd_fread, fd_fseek, fd_ftell, fd_rewind, fd_fclose, flags->mmap ? fd_fclaim : NULL, fd, 1, size, 0, NULL };
+    *l = r;
+    if (flags->direct)
+    {
+        /* Start with sector alignment, which is all BCD needs and most devices accept; mapping would bring page cache back */
+        int fl = fcntl(fd, F_GETFL);
+        if (fl == -1 || fcntl(fd, F_SETFL, fl | O_DIRECT) == -1)
         {
-            if (optind == argc) return def;
-            if (optind + 1 == argc) return argv[optind];
-            cancel(C_OPTARG_TOOMANY, "%s: specified multiple lintel/kernel paths, only a single one is expected\nRun %s --help for usage)\n", argv[0], argv[0]);
+            printf("Can't use direct I/O for %s file (%s), reading it through page cache.\n", what, strerror(errno));
+            return 0;
         }
-
+        l->dio_align = 512;
+        l->fclaim = NULL;
+        printf("Reading %s file with direct I/O.\n", what);
+    }
+    return 0;
+}
+
+#define SCAN_CHUNK (64 << 20)
+
+typedef uint64_t scan_vec_t __attribute__((vector_size(32)));
+
+static size_t scan_signature(const unsigned char *data, size_t from, size_t to)
+{
+    /* Returns offset of the first sector with BCD signature in [from, to), or to; checks four sectors per vector compare */
+    const scan_vec_t sig = { LINTEL_BCD_SIGNATURE, LINTEL_BCD_SIGNATURE, LINTEL_BCD_SIGNATURE, LINTEL_BCD_SIGNATURE };
+    size_t off = from;
+    for (; off + 4 * 512 <= to; off += 4 * 512)
+    {
+        scan_vec_t v;
+        for (int i = 0; i < 4; ++i) { uint64_t w; memcpy(&w, data + off + i * 512, sizeof(w)); v[i] = w; }
+        scan_vec_t m = (v == sig);
+        if (m[0] | m[1] | m[2] | m[3]) for (int i = 0; i < 4; ++i) if (m[i]) return off + i * 512;
+    }
+    for (; off + sizeof(uint64_t) <= to; off += 512) if (!memcmp(data + off, &LINTEL_BCD_SIGNATURE, sizeof(uint64_t))) return off;
+    return to;
+}
+
+static int bcd_valid_at(const unsigned char *data, size_t size, size_t base)
+{
+    /* Signature alone may be found in lintel's own BCD map or in random data, so table has to fit in file too */
+    struct xrt_BcdHeader_t h;
+    if (base + 512 + sizeof(h) > size) return 0;
+    memcpy(&h, data + base + 512, sizeof(h));
+    return h.signature == LINTEL_BCD_SIGNATURE && h.files_num > 0 && h.files_num <= MAX_BCD_FILES &&
+           base + 512 + sizeof(h) + h.files_num * sizeof(struct xrt_BcdFile_t) <= size && h.free_lba <= (size - base) / 512;
+}
+
+#define SCAN_STEP (1 << 20)
+
+struct scan_jobs_t
+{
+    const unsigned char *data;
+    size_t from;
+    size_t size;
+    int num;
+    int next;
+    size_t found;   /* offset of the lowest signature of valid container found so far, or size; updated atomically */
+    pthread_mutex_t lock;
+};
+
+static void *scan_worker(void *arg)
+{
+    struct scan_jobs_t *j = arg;
+    for (;;)
+    {
+        pthread_mutex_lock(&j->lock);
+        int n = j->next++;
+        pthread_mutex_unlock(&j->lock);
+        /* Chunks are taken in order, so once one starts above a container found, so do all the rest */
+        size_t from = j->from + (size_t)n * SCAN_CHUNK;
+        if (n >= j->num || from >= __atomic_load_n(&j->found, __ATOMIC_RELAXED)) break;
+        size_t to = (n == j->num - 1) ? j->size : from + SCAN_CHUNK;
+        madvise((void *)((uintptr_t)(j->data + from) & ~(uintptr_t)(alignment - 1)), to - from, MADV_WILLNEED);
+        /* Chunk is scanned in steps, so that it is left as soon as a lower container is found elsewhere */
+        while (from < to && from < __atomic_load_n(&j->found, __ATOMIC_RELAXED))
+        {
+            size_t step = (to - from < SCAN_STEP) ? to : from + SCAN_STEP;
+            size_t off = scan_signature(j->data, from, step);
+            if (off >= step) { from = step; continue; }
+            if (bcd_valid_at(j->data, j->size, off - 512))
+            {
+                size_t found = __atomic_load_n(&j->found, __ATOMIC_RELAXED);
+                while (off < found && !__atomic_compare_exchange_n(&j->found, &found, off, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+                break;
+            }
+            from = off + 512;
+        }
+    }
+    return NULL;
+}
+
+static size_t scan_parallel(const unsigned char *data, size_t from, size_t size)
+{
+    /* Returns offset of signature of the first valid container in [from, size), or size. Chunks are scanned by
+       a thread per CPU, so that page faults on mapped file are taken in parallel, and signatures not followed
+       by a valid file table are passed over right where they are found */
+    int chunks = (size - from + SCAN_CHUNK - 1) / SCAN_CHUNK;
+    struct scan_jobs_t j = { data, from, size, chunks, 0, size };
+    pthread_mutex_init(&j.lock, NULL);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads_num = (cpus < 1) ? 1 : (cpus > chunks) ? chunks : cpus;
+    pthread_t threads[threads_num];
+    int started = 0;
+    while (started < threads_num - 1 && !pthread_create(&threads[started], NULL, scan_worker, &j)) ++started;
+    scan_worker(&j);
+    for (int i = 0; i < started; ++i) pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&j.lock);
+    return j.found;
+}
+
+static int scan_partitions(const unsigned char *data, size_t size, size_t *base)
+{
+    /* Returns number of partition holding BCD container (counting from 1), or 0 */
+    if (size < 1024 || data[510] != 0x55 || data[511] != 0xaa) return 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        const unsigned char *e = data + 446 + 16 * i;
+        uint32_t start;
+        memcpy(&start, e + 8, sizeof(start));
+        if (e[4] == 0xee)
+        {
+            /* Protective MBR: look at GPT, either with 512 or 4096 byte sectors */
+            for (size_t ss = 512; ss <= 4096; ss *= 8)
+            {
+                if (2 * ss > size || memcmp(data + ss, "EFI PART", 8)) continue;
+                uint64_t entries_lba;
+                uint32_t entries_num, entry_size;
+                memcpy(&entries_lba, data + ss + 72, sizeof(entries_lba));
+                memcpy(&entries_num, data + ss + 80, sizeof(entries_num));
+                memcpy(&entry_size, data + ss + 84, sizeof(entry_size));
+                if (entry_size < 48 || entries_num > 4096 || entries_lba > size / ss) continue;
+                for (uint32_t n = 0; n < entries_num; ++n)
+                {
+                    size_t off = entries_lba * ss + (size_t)n * entry_size;
+                    if (off + 48 > size) break;
+                    static const unsigned char unused[16] = { 0 };
+                    if (!memcmp(data + off, unused, 16)) continue;
+                    uint64_t first;
+                    memcpy(&first, data + off + 32, sizeof(first));
+                    if (first <= size / ss && bcd_valid_at(data, size, first * ss)) { *base = first * ss; return n + 1; }
+                }
+            }
+        }
+        else if (e[4] != 0 && start && bcd_valid_at(data, size, (size_t)start * 512)) { *base = (size_t)start * 512; return i + 1; }
+    }
+    return 0;
+}
+
+static struct xrt_BcdHeader_t bcd_scan(struct lintelops *l)
+{
+    /* Whole file is mapped (or cached, if read from standard input) and scanned in place */
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    const unsigned char *data;
+    size_t size;
+    void *map = NULL;
+    if (l->fd != -1)
+    {
+        if (l->fsize == 0) { struct xrt_BcdHeader_t h = { 0, -1, 0 }; return h; }
+        size = l->fsize;
+        if ((map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, l->fd, 0)) == MAP_FAILED) { int e = errno; l->fclose(l); cancel(C_SCAN_MAP, "Can't map file to look for BCD container in it: %s\n", strerror(e)); }
+        madvise(map, size, MADV_SEQUENTIAL);
+        data = map;
+    }
+    else
+    {
+        if (l->fseek(l, 0, SEEK_END)) { int e = errno; l->fclose(l); cancel(C_SCAN_MAP, "Can't read file to look for BCD container in it: %s\n", strerror(e)); }
+        data = (const unsigned char *)l->cache;
+        size = l->cachesize;
+    }
+
+    size_t base = 0;
+    int part = scan_partitions(data, size, &base);
+    int found = part > 0;
+    if (!found && size > 1024)
+    {
+        size_t off = scan_parallel(data, 1024, size);
+        if (off < size) { base = off - 512; found = 1; }
+    }
+    if (map) munmap(map, size);
+    if (!found)
+    {
+        printf("No BCD container found in file (scanned %ld bytes in %.3f ms).\n", size, elapsed_since(&start));
+        struct xrt_BcdHeader_t h = { 0, -1, 0 };
+        return h;
+    }
+    if (part) printf("Found BCD container in partition %d at offset %ld.\n", part, base);
+    else printf("Found BCD container at offset %ld (scanned %ld bytes in %.3f ms).\n", base, base + 512, elapsed_since(&start));
+    l->base = base;
+    return bcd_check_files(l);
+}
+
+struct outbuf_t
+{
+    char *buf;
+    size_t size;
+    size_t alloc;
+};
+
+static int outbuf_reserve(struct outbuf_t *o, size_t size)
+{
+    /* Same geometric growth of aligned buffer as the stdin cache, as decompressed image becomes one; first reservation is exact */
+    if (o->alloc >= size) return 0;
+    size_t newalloc = o->alloc ? o->alloc : (size + alignment - 1) / alignment * alignment;
+    while (newalloc < size) newalloc *= 2;
+    char *newbuf;
+    if (posix_memalign((void**)&newbuf, alignment, newalloc)) return -1;
+    if (o->size) memcpy(newbuf, o->buf, o->size);
+    free(o->buf);
+    o->buf = newbuf;
+    o->alloc = newalloc;
+    return 0;
+}
+
+#ifdef HAVE_ZLIB
+static const char *gunzip(const unsigned char *in, size_t insize, struct outbuf_t *o)
+{
+    /* ISIZE of the last member is exact for usual single-member files, and just a hint otherwise */
+    uint32_t isize = in[insize - 4] | (in[insize - 3] << 8) | (in[insize - 2] << 16) | ((uint32_t)in[insize - 1] << 24);
+    size_t expect = (size_t)isize + alignment; expect -= expect % alignment; /* with the slack of image buffer */
+    if (outbuf_reserve(o, expect)) return "out of memory";
+
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (inflateInit2(&z, 15 + 16) != Z_OK) return "can't initialize zlib";
+    z.next_in = (unsigned char *)in;
+    for (;;)
+    {
+        size_t inleft = insize - (z.next_in - in);
+        z.avail_in = inleft > UINT_MAX ? UINT_MAX : inleft;
+        if (o->size == o->alloc && outbuf_reserve(o, o->alloc + 1)) { inflateEnd(&z); return "out of memory"; }
+        size_t outleft = o->alloc - o->size;
+        z.next_out = (unsigned char *)o->buf + o->size;
+        z.avail_out = outleft > UINT_MAX ? UINT_MAX : outleft;
+        int rv = inflate(&z, Z_NO_FLUSH);
+        o->size = (char *)z.next_out - o->buf;
+        if (rv == Z_STREAM_END)
+        {
+            /* Concatenated members are decompressed one after another, like gzip does */
+            inleft = insize - (z.next_in - in);
+            if (inleft < 2 || z.next_in[0] != 0x1f || z.next_in[1] != 0x8b) break;
+            inflateReset(&z);
+            continue;
+        }
+        if (rv == Z_BUF_ERROR && z.avail_in == 0) { inflateEnd(&z); return "unexpected end of data"; }
+        if (rv != Z_OK && rv != Z_BUF_ERROR) { inflateEnd(&z); return z.msg ? z.msg : "corrupt data"; }
+    }
+    inflateEnd(&z);
+    return NULL;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+struct zstd_job_t
+{
+    const void *src;
+    size_t srcsize;
+    void *dst;
+    size_t dstsize;
+    size_t result;
+};
+
+struct zstd_jobs_t
+{
+    struct zstd_job_t *jobs;
+    int num;
+    int next;
+    pthread_mutex_t lock;
+};
+
+static void *zstd_worker(void *arg)
+{
+    struct zstd_jobs_t *j = arg;
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    for (;;)
+    {
+        pthread_mutex_lock(&j->lock);
+        int n = j->next++;
+        pthread_mutex_unlock(&j->lock);
+        if (n >= j->num) break;
+        struct zstd_job_t *job = &j->jobs[n];
+        job->result = dctx ? ZSTD_decompressDCtx(dctx, job->dst, job->dstsize, job->src, job->srcsize) : (size_t)-1;
+    }
+    if (dctx) ZSTD_freeDCtx(dctx);
+    return NULL;
+}
+
+static const char *unzstd_frames(const unsigned char *in, size_t insize, struct outbuf_t *o, int *done)
+{
+    /* If every frame declares its size, frames are decompressed in parallel right to their final places */
+    int frames = 0;
+    unsigned long long total = 0;
+    *done = 0;
+    for (size_t off = 0; off < insize; ++frames)
+    {
+        size_t fsize = ZSTD_findFrameCompressedSize(in + off, insize - off);
+        unsigned long long csize = ZSTD_getFrameContentSize(in + off, insize - off);
+        if (ZSTD_isError(fsize)) return "corrupt data";
+        if (csize == ZSTD_CONTENTSIZE_UNKNOWN || csize == ZSTD_CONTENTSIZE_ERROR) return NULL;
+        total += csize;
+        off += fsize;
+    }
+    size_t expect = total + alignment; expect -= expect % alignment;
+    if (outbuf_reserve(o, expect)) return "out of memory";
+
+    struct zstd_jobs_t j = { calloc(frames, sizeof(struct zstd_job_t)), frames, 0 };
+    if (j.jobs == NULL) return "out of memory";
+    size_t off = 0, outoff = 0;
+    for (int i = 0; i < frames; ++i)
+    {
+        j.jobs[i].src = in + off;
+        j.jobs[i].srcsize = ZSTD_findFrameCompressedSize(in + off, insize - off);
+        j.jobs[i].dst = o->buf + outoff;
+        j.jobs[i].dstsize = ZSTD_getFrameContentSize(in + off, insize - off);
+        off += j.jobs[i].srcsize;
+        outoff += j.jobs[i].dstsize;
+    }
+
+    pthread_mutex_init(&j.lock, NULL);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads_num = (cpus < 1) ? 1 : (cpus > frames) ? frames : cpus;
+    pthread_t threads[threads_num];
+    int started = 0;
+    while (started < threads_num - 1 && !pthread_create(&threads[started], NULL, zstd_worker, &j)) ++started;
+    zstd_worker(&j);
+    for (int i = 0; i < started; ++i) pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&j.lock);
+
+    const char *err = NULL;
+    for (int i = 0; i < frames; ++i) if (j.jobs[i].result != j.jobs[i].dstsize) err = ZSTD_isError(j.jobs[i].result) ? ZSTD_getErrorName(j.jobs[i].result) : "frame size mismatch";
+    free(j.jobs);
+    if (err) return err;
+    o->size = total;
+    *done = 1;
+    if (frames > 1) printf("Decompressed %d zstd frames using %d threads.\n", frames, threads_num);
+    return NULL;
+}
+
+static const char *unzstd(const unsigned char *in, size_t insize, struct outbuf_t *o)
+{
+    int done;
+    const char *err = unzstd_frames(in, insize, o, &done);
+    if (err || done) return err;
+
+    ZSTD_DStream *ds = ZSTD_createDStream();
+    if (ds == NULL) return "can't initialize zstd";
+    ZSTD_inBuffer ib = { in, insize, 0 };
+    size_t rv = 1;
+    while (ib.pos < ib.size)
+    {
+        if (o->size == o->alloc && outbuf_reserve(o, o->alloc + 1)) { ZSTD_freeDStream(ds); return "out of memory"; }
+        ZSTD_outBuffer ob = { o->buf, o->alloc, o->size };
+        rv = ZSTD_decompressStream(ds, &ob, &ib);
+        o->size = ob.pos;
+        if (ZSTD_isError(rv)) { ZSTD_freeDStream(ds); return ZSTD_getErrorName(rv); }
+    }
+    /* Flush whatever is still buffered in decoder */
+    while (rv != 0)
+    {
+        if (o->size == o->alloc && outbuf_reserve(o, o->alloc + 1)) { ZSTD_freeDStream(ds); return "out of memory"; }
+        ZSTD_outBuffer ob = { o->buf, o->alloc, o->size };
+        rv = ZSTD_decompressStream(ds, &ob, &ib);
+        if (ZSTD_isError(rv)) { ZSTD_freeDStream(ds); return ZSTD_getErrorName(rv); }
+        if (ob.pos == o->size && rv != 0) { ZSTD_freeDStream(ds); return "unexpected end of data"; }
+        o->size = ob.pos;
+    }
+    ZSTD_freeDStream(ds);
+    return NULL;
+}
+#endif
+
+#ifdef HAVE_LZMA
+static const char *unxz(const unsigned char *in, size_t insize, struct outbuf_t *o)
+{
+    lzma_stream z = LZMA_STREAM_INIT;
+    lzma_ret rv;
+#ifdef HAVE_LZMA_MT
+    /* Multi-threaded decoder works on files with block sizes stored in headers (e.g. xz -T0 output) */
+    lzma_mt mt;
+    memset(&mt, 0, sizeof(mt));
+    mt.flags = LZMA_CONCATENATED;
+    mt.threads = lzma_cputhreads();
+    if (mt.threads == 0) mt.threads = 1;
+    mt.memlimit_threading = UINT64_MAX;
+    mt.memlimit_stop = UINT64_MAX;
+    rv = lzma_stream_decoder_mt(&z, &mt);
+#else
+    rv = lzma_stream_decoder(&z, UINT64_MAX, LZMA_CONCATENATED);
+#endif
+    if (rv != LZMA_OK) return "can't initialize liblzma";
+    if (outbuf_reserve(o, insize * 4)) { lzma_end(&z); return "out of memory"; }
+
+    z.next_in = in;
+    z.avail_in = insize;
+    for (;;)
+    {
+        if (o->size == o->alloc && outbuf_reserve(o, o->alloc + 1)) { lzma_end(&z); return "out of memory"; }
+        z.next_out = (uint8_t *)o->buf + o->size;
+        z.avail_out = o->alloc - o->size;
+        rv = lzma_code(&z, LZMA_FINISH);
+        o->size = (char *)z.next_out - o->buf;
+        if (rv == LZMA_STREAM_END) break;
+        if (rv != LZMA_OK) { lzma_end(&z); return (rv == LZMA_BUF_ERROR) ? "unexpected end of data" : "corrupt data"; }
+    }
+    lzma_end(&z);
+    return NULL;
+}
+#endif
+
+static void set_memory_stream(struct lintelops *l, struct outbuf_t *o)
+{
+    /* Decompressed image is then read just like a fully cached standard input */
+    l->cache = o->buf;
+    l->cachesize = o->size;
+    l->cachealloc = o->alloc;
+    l->fptr = 0;
+    l->streampos = o->size;
+    l->src = NULL;
+    l->fread = stdin_fread;
+    l->fseek = stdin_fseek;
+    l->ftell = stdin_ftell;
+    l->rewind = stdin_rewind;
+    l->fclose = stdin_fclose;
+    l->fclaim = stdin_fclaim;
+}
+
+static void maybe_decompress(struct lintelops *l, const char *what, const struct flags_t *flags)
+{
+    /* Replaces the stream with decompressed image in memory, if the file turns out to be compressed */
+    unsigned char magic[6];
+    size_t got = l->fread(l, magic, 1, sizeof(magic));
+    l->rewind(l);
+    const char *format = NULL;
+    if (got >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) format = "gzip";
+    if (got >= 4 && !memcmp(magic, "\x28\xb5\x2f\xfd", 4)) format = "zstd";
+    if (got >= 6 && !memcmp(magic, "\xfd" "7zXZ\0", 6)) format = "xz";
+    if (format == NULL || !flags->decompress) return;
+
+    const char *(*decompress)(const unsigned char *in, size_t insize, struct outbuf_t *o) = NULL;
+#ifdef HAVE_ZLIB
+    if (!strcmp(format, "gzip")) decompress = gunzip;
+#endif
+#ifdef HAVE_ZSTD
+    if (!strcmp(format, "zstd")) decompress = unzstd;
+#endif
+#ifdef HAVE_LZMA
+    if (!strcmp(format, "xz")) decompress = unxz;
+#endif
+    if (decompress == NULL) { l->fclose(l); cancel(C_DECOMP_UNSUPPORTED, "The %s file is %s-compressed, but %s support is not built in (use --no-decompress to load it as is)\n", what, format, format); }
+
+    /* Get the whole compressed file in memory: map regular files, read anything else */
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    const unsigned char *in;
+    size_t insize;
+    void *map = NULL;
+    if (l->fd != -1 && l->dio_align == 1)
+    {
+        insize = l->fsize;
+        if ((map = mmap(NULL, insize, PROT_READ, MAP_PRIVATE | MAP_POPULATE, l->fd, 0)) == MAP_FAILED) { l->fclose(l); cancel(C_DECOMP_INPUT, "Can't map %s file: %s\n", what, strerror(errno)); }
+        madvise(map, insize, MADV_SEQUENTIAL);
+        in = map;
+    }
+    else if (l->fd != -1)
+    {
+        insize = l->fsize;
+        if (posix_memalign(&map, alignment, insize + alignment)) { l->fclose(l); cancel(C_DECOMP_INPUT, "Can't allocate %ld bytes for %s file\n", insize, what); }
+        if (l->fread(l, map, insize, 1) != 1) { int e = errno; free(map); l->fclose(l); cancel(C_DECOMP_INPUT, "Can't read %s file: %s\n", what, strerror(e)); }
+        in = map;
+    }
+    else
+    {
+        if (l->fseek(l, 0, SEEK_END)) { int e = errno; l->fclose(l); cancel(C_DECOMP_INPUT, "Can't read %s file: %s\n", what, strerror(e)); }
+        in = (unsigned char *)l->cache;
+        insize = l->cachesize;
+    }
+
+    struct outbuf_t o = { NULL, 0, 0 };
+    const char *err = (insize < 18) ? "file is too short" : decompress(in, insize, &o);
+    if (map && l->dio_align == 1) munmap(map, insize);
+    else free(map);
+    l->fclose(l);
+    if (err) { free(o.buf); cancel(C_DECOMP_DATA, "Can't decompress %s file (%s): %s\n", what, format, err); }
+
+    /* Leave room for the slack read_image() would allocate, so the buffer can be handed over as is */
+    size_t aligned_size = o.size + alignment; aligned_size -= aligned_size % alignment;
+    if (outbuf_reserve(&o, aligned_size)) { free(o.buf); cancel(C_DECOMP_ALLOC, "Can't allocate %ld bytes for decompressed %s file\n", aligned_size, what); }
+    printf("Decompressed %s file (%s): %ld bytes to %ld bytes in %.3f ms.\n", what, format, insize, o.size, elapsed_since(&start));
+    set_memory_stream(l, &o);
+}
+
+static uint64_t hash64(const void *data, size_t size, uint64_t seed)
+{
+    /* Not cryptographic; fast enough to catch stale or damaged cache entries at memory speed */
+    const unsigned char *p = data;
+    uint64_t h = seed ^ (size * 0x9e3779b97f4a7c15ull);
+    for (; size >= 8; p += 8, size -= 8)
+    {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = (h ^ (w * 0xff51afd7ed558ccdull)) * 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 29;
+    }
+    uint64_t w = 0;
+    memcpy(&w, p, size);
+    h = (h ^ (w * 0xff51afd7ed558ccdull)) * 0xc4ceb9fe1a85ec53ull;
+    return h ^ (h >> 32);
+}
+
+static uint64_t hash_file(uint64_t h, const char *path, const struct stat *st)
+{
+    h = hash64(path, strlen(path), h);
+    uint64_t fields[] = { st->st_dev, st->st_ino, st->st_size, st->st_mtim.tv_sec, st->st_mtim.tv_nsec };
+    return hash64(fields, sizeof(fields), h);
+}
+
+static uint64_t payload_key(uint64_t h, const char *initrd, const struct flags_t *flags)
+{
+    /* Image identity h, plus everything else that ends up in prepared payload; 0 if some of it can't be told */
+    struct stat st;
+    uint32_t inputs[] = { flags->iskernel, flags->noinitrd, flags->scan, flags->decompress, flags->stripelf };
+    h = hash64(inputs, sizeof(inputs), h);
+    if (!flags->noinitrd)
+    {
+        if (stat(initrd, &st) == -1) return 0;
+        h = hash_file(h, initrd, &st);
+        for (int i = 1; i < flags->initrds_num; ++i)
+        {
+            if (stat(flags->initrds[i], &st) == -1) return 0;
+            h = hash_file(h, flags->initrds[i], &st);
+        }
+    }
+    return h ? h : 1;
+}
+
+static uint64_t cache_key(int fd, const char *path, const char *initrd, const struct flags_t *flags)
+{
+    /* 0 if the payload can't be cached */
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) return 0;
+    return payload_key(hash_file(CACHE_VERSION, path, &st), initrd, flags);
+}
+
+static int cache_trusted(const char *what, const char *path, const struct stat *st)
+{
+    /* Payload gets booted as is, so anything others could have put or changed in cache is not used */
+    if (st->st_uid == geteuid() && !(st->st_mode & (S_IWGRP | S_IWOTH))) return 1;
+    printf("Cache %s %s is not owned by user %d or is writable by others, not using it.\n", what, path, (int)geteuid());
+    return 0;
+}
+
+static int cache_dir_trusted(const char *dir)
+{
+    struct stat st;
+    if (stat(dir, &st) == -1) return 0;
+    if (!S_ISDIR(st.st_mode)) { printf("Cache directory %s is not a directory, not using it.\n", dir); return 0; }
+    return cache_trusted("directory", dir, &st);
+}
+
+static uint64_t payload_hash(const void *image, uint64_t image_size, const void *initrd, uint64_t initrd_size, uint64_t key)
+{
+    /* Buffers are hashed where they are, one after another */
+    uint64_t h = hash64(image, image_size, key);
+    return initrd_size ? hash64(initrd, initrd_size, h) : h;
+}
+
+static int cache_load(const char *dir, uint64_t key, struct flags_t *flags)
+{
+    char path[PATH_MAX];
+    if (path_snprintf_nc(path, "%s/%016llx.payload", dir, (unsigned long long)key) == -1) return 0;
+    if (!cache_dir_trusted(dir)) return 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd == -1) return 0;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || !cache_trusted("file", path, &st) || st.st_size < alignment) { close(fd); return 0; }
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return 0;
+
+    /* Sizes are compared with room left in file one by one, so that no sum of them can wrap around */
+    const struct cache_header_t *h = p;
+    uint64_t room = st.st_size - alignment, image_aligned = h->image_size + alignment - 1;
+    image_aligned = (h->image_size <= room) ? image_aligned - image_aligned % alignment : UINT64_MAX;
+    if (h->magic != CACHE_MAGIC || h->version != CACHE_VERSION || h->key != key || h->image_size == 0 || image_aligned > room || h->initrd_size > room - image_aligned ||
+        (h->jumper_offset >= 0 && (uint64_t)h->jumper_offset + sizeof(struct kexec_info_t) > h->image_size) ||
+        payload_hash((char*)p + alignment, h->image_size, (char*)p + alignment + image_aligned, h->initrd_size, key) != h->content_hash)
+    {
+        printf("Cached payload %s is stale or damaged, ignoring it.\n", path);
+        munmap(p, st.st_size);
+        return 0;
+    }
+    struct buffer_t buf = { p, st.st_size, 1, 0 };
+    lock_buffer(&buf);
+    if (mprotect(p, st.st_size, PROT_READ | PROT_WRITE)) { if (buf.locked) munlock(p, st.st_size); munmap(p, st.st_size); return 0; }
+
+    add_buffer(&buf);
+    void *image = (char*)p + alignment;
+    flags->iskernel = h->iskernel;
+    flags->noinitrd = h->noinitrd;
+    if (h->iskernel)
+    {
+        kernel.image = image;
+        kernel.image_size = h->image_size;
+        kernel.initrd = h->initrd_size ? (char*)image + image_aligned : NULL;
+        kernel.initrd_size = h->initrd_size;
+    }
+    else
+    {
+        lintel.image = image;
+        lintel.image_size = h->image_size;
+        jumper_info = (h->jumper_offset >= 0) ? (struct kexec_info_t *)((char*)image + h->jumper_offset) : NULL;
+    }
+    printf("Loaded prepared payload from cache %s: %llu bytes at address %p.\n", path, (unsigned long long)(h->image_size + h->initrd_size), image);
+    return 1;
+}
+
+static int write_all(int fd, const void *buf, size_t size)
+{
+    while (size)
+    {
+        ssize_t w = write(fd, buf, size);
+        if (w == -1 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        buf = (const char *)buf + w;
+        size -= w;
+    }
+    return 0;
+}
+
+static void cache_store(const char *dir, uint64_t key, const struct flags_t *flags)
+{
+    /* Failing to store prepared payload is not a reason to refuse booting it */
+    char path[PATH_MAX], tmp[PATH_MAX];
+    if (path_snprintf_nc(path, "%s/%016llx.payload", dir, (unsigned long long)key) == -1 || path_snprintf_nc(tmp, "%s/.%016llx.XXXXXX", dir, (unsigned long long)key) == -1)
+    {
+        printf("Path to cache directory %s is too long, payload is not cached.\n", dir);
+        return;
+    }
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) { printf("Can't create cache directory %s: %s\n", dir, strerror(errno)); return; }
+    if (!cache_dir_trusted(dir)) return;
+
+    static const char zeros[ALIGNMENT];
+    struct cache_header_t h;
+    memset(&h, 0, sizeof(h));
+    h.magic = CACHE_MAGIC;
+    h.version = CACHE_VERSION;
+    h.iskernel = flags->iskernel;
+    h.noinitrd = flags->noinitrd;
+    h.key = key;
+    h.image_size = flags->iskernel ? kernel.image_size : lintel.image_size;
+    h.initrd_size = flags->iskernel ? kernel.initrd_size : 0;
+    h.jumper_offset = (!flags->iskernel && jumper_info) ? (char*)jumper_info - (char*)lintel.image : -1;
+    const void *image = flags->iskernel ? kernel.image : lintel.image;
+    size_t pad = (alignment - h.image_size % alignment) % alignment;
+
+    h.content_hash = payload_hash(image, h.image_size, kernel.initrd, h.initrd_size, key);
+
+    int fd = mkstemp(tmp);
+    if (fd == -1) { printf("Can't create cache file in %s: %s\n", dir, strerror(errno)); return; }
+    if (write_all(fd, &h, sizeof(h)) || write_all(fd, zeros, alignment - sizeof(h)) || write_all(fd, image, h.image_size) || write_all(fd, zeros, pad) ||
+        (h.initrd_size && write_all(fd, kernel.initrd, h.initrd_size)) || close(fd) || rename(tmp, path))
+    {
+        printf("Can't write cache file %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+        return;
+    }
+    printf("Prepared payload is cached as %s.\n", path);
+}
+
+struct initrd_piece_t
+{
+    const char *path;
+    int fd;
+    size_t size;
+    size_t offset;
+    char *dst;
+    int err;
+};
+
+static void *initrd_reader(void *arg)
+{
+    struct initrd_piece_t *p = arg;
+    size_t done = 0;
+    while (done < p->size)
+    {
+        struct iovec iov = { p->dst + done, p->size - done };
+        ssize_t r = preadv(p->fd, &iov, 1, done);
+        if (r == -1 && errno == EINTR) continue;
+        if (r <= 0) { p->err = r ? errno : ENODATA; break; }
+        done += r;
+    }
+    return NULL;
+}
+
+static void load_initrds(const char * const *paths, int num)
+{
+    /* Sizes are known up front, so pieces are read in parallel straight to their places in a single buffer */
+    struct initrd_piece_t pieces[MAX_INITRDS];
+    size_t total = 0;
+    for (int i = 0; i < num; ++i)
+    {
+        struct stat st;
+        pieces[i].path = paths[i];
+        pieces[i].err = 0;
+        if ((pieces[i].fd = open(paths[i], O_RDONLY | O_CLOEXEC)) == -1 || fstat(pieces[i].fd, &st) == -1)
+        {
+            int e = errno;
+            for (int j = 0; j <= i; ++j) if (pieces[j].fd != -1) close(pieces[j].fd);
+            cancel(C_LINUX_OPEN_INITRD, "Can't open initrd file %s: %s\n", paths[i], strerror(e));
+        }
+        pieces[i].size = S_ISBLK(st.st_mode) ? lseek(pieces[i].fd, 0, SEEK_END) : st.st_size;
+        posix_fadvise(pieces[i].fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        /* Kernel expects each cpio archive (compressed or not) to start at 4-byte boundary, and skips zeros between them */
+        total = (total + 3) & ~(size_t)3;
+        pieces[i].offset = total;
+        total += pieces[i].size;
+    }
+
+    size_t aligned_size = total + alignment; aligned_size -= aligned_size % alignment;
+    struct buffer_t buf;
+    const char *huge = NULL;
+    if (use_hugepages && total >= huge_threshold) huge = alloc_huge(aligned_size, &buf);
+    if (huge == NULL)
+    {
+        if (posix_memalign(&buf.addr, alignment, aligned_size)) { for (int i = 0; i < num; ++i) close(pieces[i].fd); cancel(C_FILE_ALLOC, "Can't allocate %ld bytes for %d initrd files of %ld bytes\n", aligned_size, num, total); }
+        buf.size = aligned_size;
+        buf.mapped = 0;
+        buf.locked = 0;
+    }
+    memset((char *)buf.addr + total, 0, buf.size - total);
+
+    pthread_t threads[MAX_INITRDS];
+    int started[MAX_INITRDS];
+    for (int i = 0; i < num; ++i)
+    {
+        pieces[i].dst = (char *)buf.addr + pieces[i].offset;
+        if (i > 0) memset(pieces[i - 1].dst + pieces[i - 1].size, 0, pieces[i].dst - (pieces[i - 1].dst + pieces[i - 1].size));
+        started[i] = (i < num - 1) && !pthread_create(&threads[i], NULL, initrd_reader, &pieces[i]);
+    }
+    for (int i = 0; i < num; ++i) if (!started[i]) initrd_reader(&pieces[i]);
+    for (int i = 0; i < num; ++i) if (started[i]) pthread_join(threads[i], NULL);
+
+    kernel.initrd = buf.addr;
+    kernel.initrd_size = total;
+    add_buffer(&buf);
+    for (int i = 0; i < num; ++i)
+    {
+        close(pieces[i].fd);
+        if (pieces[i].err) cancel(C_LINUX_READ_INITRD, "Can't read %ld bytes of initrd file %s: %s\n", pieces[i].size, pieces[i].path, (pieces[i].err == ENODATA) ? "file might be truncated" : strerror(pieces[i].err));
+        printf("Loaded initrd from %s: %ld bytes at offset %ld\n", pieces[i].path, pieces[i].size, pieces[i].offset);
+    }
+    printf("Loaded %d initrd files%s: %ld bytes at address %p (%ld bytes aligned at 0x%lx)\n", num, huge ? " into huge pages" : "", total, buf.addr, buf.size, alignment);
+}
+
+struct kernel_load_t
+{
+    struct lintelops *l;
+    size_t realsize;
+    const char *initrd;
+    const struct flags_t *flags;
+};
+
+static void *kernel_main(void *arg)
+{
+    struct kernel_load_t *kl = arg;
+    int ph = phase_begin("load_image.kernel");
+    if (!kl->flags->stripelf || read_elf_kernel(kl->l, kl->realsize)) read_image(kl->l, kl->realsize, &kernel.image, &kernel.image_size, "kernel");
+    phase_end(ph, kernel.image_size);
+    return NULL;
+}
+
+static void *initrd_main(void *arg)
+{
+    struct kernel_load_t *kl = arg;
+    const struct flags_t *flags = kl->flags;
+    int ph = phase_begin("load_image.initrd");
+    if (flags->initrds_num > 1)
+    {
+        load_initrds(flags->initrds, flags->initrds_num);
+    }
+    else
+    {
+        struct lintelops s;
+        if (reader_open(&s, kl->initrd, "initrd", flags)) cancel(C_LINUX_OPEN_INITRD, "Can't open initrd file %s: %s\n", kl->initrd, strerror(errno));
+        size_t realsize = get_fsize(&s);
+        printf("Loading initrd from %s:\n", kl->initrd);
+        read_image(&s, realsize, &kernel.initrd, &kernel.initrd_size, "initrd");
+    }
+    phase_end(ph, kernel.initrd_size);
+    return NULL;
+}
+
+static void *cmdline_main(void *arg)
+{
+    int ph = phase_begin("load_image.cmdline");
+    char cmdlinefile[PATH_MAX];
+    read_sysfs(root_path(cmdlinefile, proc_root, "/cmdline"), &current_cmdline, NULL);
+    *strchrnul(current_cmdline, '\n') = '\0';
+    phase_end(ph, 0);
+    return NULL;
+}
+
+static void load_kernel(struct kernel_load_t *kl)
+{
+    /* Kernel, initrd and current command line don't depend on each other, so they are read at once */
+    struct { const char *what; void *(*fn)(void *arg); int needed; struct worker_t w; int started; } jobs[] =
+    {
+        { "kernel", kernel_main, 1 },
+        { "initrd", initrd_main, !kl->flags->noinitrd },
+        { "command line", cmdline_main, kl->flags->cmdline != 'c' },
+    };
+    const int jobs_num = sizeof(jobs) / sizeof(jobs[0]);
+    if (kl->flags->noinitrd) kernel.initrd_size = 0;
+    for (int i = 0; i < jobs_num; ++i) jobs[i].started = jobs[i].needed && !start_worker(&jobs[i].w, jobs[i].fn, kl);
+
+    /* Anything that could not be started in background is done right here, with its failure kept until workers are joined */
+    for (int i = 0; i < jobs_num; ++i) if (jobs[i].needed && !jobs[i].started) run_inline(&jobs[i].w, jobs[i].fn, kl);
+
+    /* All workers are waited for, so that every failure is reported, and none is left writing to buffers */
+    int code = C_SUCCESS, failed = 0;
+    char msg[sizeof(jobs[0].w.msg) * 3] = "";
+    for (int i = 0; i < jobs_num; ++i)
+    {
+        if (!jobs[i].needed || (jobs[i].started ? join_worker(&jobs[i].w) : jobs[i].w.code) == C_SUCCESS) continue;
+        if (code == C_SUCCESS) code = jobs[i].w.code;
+        ++failed;
+        size_t len = strlen(msg);
+        snprintf(msg + len, sizeof(msg) - len, "%s", jobs[i].w.msg);
+    }
+    if (code != C_SUCCESS) cancel(code, "%s%s", (failed > 1) ? "Loading kernel failed in several places:\n" : "", msg);
+}
+
+static void load_image(const char *fname, const char *initrd, struct flags_t *flags)
+{
+    char path[PATH_MAX] = "";
+    uint64_t key = 0;
+    struct lintelops l;
+    if(strcmp(fname, "-"))
+    {
+        /* May be undefined in non-POSIX environments; then we don't expand tilde. */
+        #ifndef GLOB_TILDE
+            #define GLOB_TILDE 0
+        #endif
+
+        printf("Requested image path: %s\n", fname);
+        glob_t globbuf;
+        switch(glob(fname, GLOB_ERR | GLOB_TILDE, NULL, &globbuf))
+        {
+            case 0:
+                if (globbuf.gl_pathc != 1)
+                {
+                    globfree(&globbuf);
+                    cancel(C_GLOB_AMBIG, "Ambiguous pattern %s matching %d files\n", fname, globbuf.gl_pathc);
+                }
+                break;
+
+            case GLOB_NOSPACE:
+                globfree(&globbuf);
+                cancel(C_GLOB_ALLOC, "No memory globbing %s\n", fname);
+
+            case GLOB_ABORTED:
+                globfree(&globbuf);
+                cancel(C_GLOB_ABORT, "Read error while globbing %s\n", fname);
+
+            case GLOB_NOMATCH:
+                globfree(&globbuf);
+                cancel(C_GLOB_NONE, "No files found matching %s\n", fname);
+
+            default:
+                globfree(&globbuf);
+                cancel(C_GLOB_UNEXPECTED, "Unexpected error globbing %s, internal result: %s\n", fname, strerror(errno));
+        }
+
+        int toolong = path_snprintf_nc(path, "%s", globbuf.gl_pathv[0]);
+        globfree(&globbuf);
+        if (toolong) cancel(C_PATH_LONG, "Path to image file is greater than %d bytes", PATH_MAX - 1);
+        if (reader_open(&l, path, "image", flags)) cancel(C_FILE_OPEN_IMAGE, "Can't open image file %s: %s\n", fname, strerror(errno));
+        printf("Loading image from %s:\n", path);
+
+        if (flags->cache && (key = cache_key(l.fd, path, initrd, flags)) && cache_load(flags->cache, key, flags))
+        {
+            l.fclose(&l);
+            return;
+        }
+    }
+    else
+    {
+        printf("Piping image from standard input\n");
+        reader_stream(&l, stdin);
+    }
+
+    maybe_decompress(&l, "image", flags);
+    struct xrt_BcdHeader_t header = bcd_check_files(&l);
+    if (header.files_num == -1 && flags->scan) header = bcd_scan(&l);
+    if (header.files_num == -1)
+    {
+        /* Whole disk or partition is never a raw lintel or kernel image */
+        struct stat st;
+        if (l.fd != -1 && !fstat(l.fd, &st) && S_ISBLK(st.st_mode))
+        {
+            l.fclose(&l);
+            cancel(C_BCD_DEVICE, "No lintel BCD image on %s%s\n", path, flags->scan ? "" : " (use --scan if it is inside a partition table)");
+        }
+        size_t realsize = get_fsize(&l);
+
+        if(flags->iskernel)
+        {
+            printf ("File seems to be a kernel image.\n");
+            struct kernel_load_t kl = { &l, realsize, initrd, flags };
+            load_kernel(&kl);
+        }
+        else
+        {
+            printf ("File seems to be raw lintel image, so NVRAM image, boot disk, VGA card and trusted mode won't be passed.\n");
+            read_image(&l, realsize, &lintel.image, &lintel.image_size, "lintel");
+        }
+    }
+    else
+    {
+        flags->iskernel = 0;
+        load_bcd_lintel(&l, header, initrd, flags);
+    }
+
+    if (key) cache_store(flags->cache, key, flags);
+}
+
+struct loader_t
+{
+    const char *fname;
+    const char *initrd;
+    struct flags_t *flags;
+};
+
+static void *loader_main(void *arg)
+{
+    struct loader_t *ld = arg;
+    int ph = phase_begin("load_image");
+    load_image(ld->fname, ld->initrd, ld->flags);
+    phase_end(ph, ld->flags->iskernel ? kernel.image_size + kernel.initrd_size : lintel.image_size);
+    return NULL;
+}
+
+static void finish_image(const char *cmdline, const struct flags_t *flags, const struct kexec_info_t *kexec_info)
+{
+    /* Everything that depends on the running system and not on image files only */
+    if (flags->iskernel)
+    {
+        char *oldcmdline = current_cmdline;
+        current_cmdline = NULL;
+        if(flags->cmdline != 'c' && oldcmdline == NULL)
+        {
+            char cmdlinefile[PATH_MAX];
+            read_sysfs(root_path(cmdlinefile, proc_root, "/cmdline"), &oldcmdline, NULL);
+            *strchrnul(oldcmdline, '\n') = '\0';
+        }
+        if(((flags->cmdline == 'c') ? strlen(cmdline) : (strlen(oldcmdline) + ((flags->cmdline == 1) ? 0 : (strlen(cmdline) + 1)))) >= COMMAND_LINE_SIZE)
+        {
+            if (oldcmdline) free(oldcmdline);
+            cancel(C_LINUX_RESCMDLINE_LONG, "Command line to pass to kernel is longer than %d bytes\n", COMMAND_LINE_SIZE);
+        }
+
+        switch(flags->cmdline)
+        {
+            case 1:
+                strcpy(kernel.cmdline, oldcmdline);
+                break;
+            case 'a':
+                strcpy(kernel.cmdline, oldcmdline);
+                strcat(kernel.cmdline, " ");
+                strcat(kernel.cmdline, cmdline);
+                break;
+            case 'c':
+                strcpy(kernel.cmdline, cmdline);
+                break;
+        }
+        if (oldcmdline) free(oldcmdline);
+        kernel.cmdline_size = strlen(kernel.cmdline);
+        printf("Kernel command line: %s\n", kernel.cmdline);
+    }
+    else if (jumper_info)
+    {
+        inject_kexec_info(kexec_info, jumper_info, flags);
+    }
+}
+
+#define SYSLOG_ANCHOR 256
+
+static int read_syslog(char **buf)
+{
+    /* Fallback for kernels without /dev/kmsg: the whole ring buffer is read at once, returns its length */
+    int size = klogctl(10, NULL, 0);
+    if (size <= 0) return -1;
+    if ((*buf = malloc(size + 1)) == NULL) return -1;
+    int len = klogctl(3, *buf, size);
+    if (len < 0) { free(*buf); return -1; }
+    (*buf)[len] = '\0';
+    return len;
+}
+
+static int syslog_anchor(char *anchor)
+{
+    /* End of the ring buffer before the trigger marks where new records start; anchor is SYSLOG_ANCHOR + 1 bytes */
+    char *buf;
+    int len = read_syslog(&buf);
+    if (len < 0) return -1;
+    int n = (len < SYSLOG_ANCHOR) ? len : SYSLOG_ANCHOR;
+    memcpy(anchor, buf + len - n, n);
+    anchor[n] = '\0';
+    free(buf);
+    return 0;
+}
+
+static int syslog_seen(const char *marker, const char *anchor)
+{
+    /* Marker is looked for after the last occurrence of anchor only; if the ring has wrapped past anchor, everything left in it is new */
+    char *buf;
+    if (read_syslog(&buf) < 0) return -1;
+    char *from = buf;
+    if (*anchor) for (char *p = buf; (p = strstr(p, anchor)) != NULL; ++p) from = p + strlen(anchor);
+    int found = (strstr(from, marker) != NULL);
+    free(buf);
+    return found;
+}
+
+static int wait_kmsg(int fd, const char *marker, int timeout)
+{
+    /* Reader position was moved to the end of the log before the trigger, so every record we get here is a new one */
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char rec[8192];
+    for (;;)
+    {
+        ssize_t r = read(fd, rec, sizeof(rec) - 1);
+        if (r > 0)
+        {
+            rec[r] = '\0';
+            char *msg = strchr(rec, ';');
+            if (msg && strstr(msg + 1, marker)) return 0;
+            continue;
+        }
+        if (r == -1 && errno == EPIPE) continue; /* Some records were overwritten before we read them; just go on */
+        if (r == -1 && errno != EAGAIN && errno != EINTR) return -1;
+
+        int left = -1;
+        if (timeout)
+        {
+            long ms = timeout * 1000L - (long)elapsed_since(&start);
+            if (ms <= 0) return 1;
+            left = ms;
+        }
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, left) == -1 && errno != EINTR) return -1;
+    }
+}
+
+static void remount_filesystems(int timeout)
+{
+    const char marker[] = "Emergency Remount complete";
+    struct timespec start;
+    char path[PATH_MAX];
+    int fd = open(root_path(path, dev_root, "/kmsg"), O_RDONLY | O_NONBLOCK);
+    if (fd != -1 && lseek(fd, 0, SEEK_END) == -1) { close(fd); fd = -1; }
+    char anchor[SYSLOG_ANCHOR + 1];
+    int anchored = (fd == -1) ? syslog_anchor(anchor) : 0;
+
+    write_sysfs(root_path(path, proc_root, "/sys/kernel/printk"),"7\n");
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    write_sysfs(root_path(path, proc_root, "/sysrq-trigger"),"u\n");
+
+    if (fd != -1)
+    {
+        int rv = wait_kmsg(fd, marker, timeout);
+        int e = errno;
+        close(fd);
+        if (rv == -1) cancel(C_REMOUNT_KMSG, "Can't read kernel log while waiting for emergency remount: %s\n", strerror(e));
+        if (rv == 1) cancel(C_REMOUNT_TIMEOUT, "Emergency remount did not complete in %d seconds\n", timeout);
+    }
+    else
+    {
+        if (anchored < 0) cancel(C_REMOUNT_KMSG, "Can't read kernel log while waiting for emergency remount: %s\n", strerror(errno));
+        for (;;)
+        {
+            int found = syslog_seen(marker, anchor);
+            if (found < 0) cancel(C_REMOUNT_KMSG, "Can't read kernel log while waiting for emergency remount: %s\n", strerror(errno));
+            if (found) break;
+            if (timeout && elapsed_since(&start) >= timeout * 1000.0) cancel(C_REMOUNT_TIMEOUT, "Emergency remount did not complete in %d seconds\n", timeout);
+            usleep(10000);
+        }
+    }
+    printf("Emergency remount completed in %.3f ms.\n", elapsed_since(&start));
+}
+
+static void unescape_mountinfo(char *s)
+{
+    /* Spaces, tabs, newlines and backslashes are escaped as \ooo in /proc/self/mountinfo */
+    char *d = s;
+    while (*s)
+    {
+        if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' && s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7')
+        {
+            *d++ = (s[1] - '0') * 64 + (s[2] - '0') * 8 + (s[3] - '0');
+            s += 4;
+        }
+        else *d++ = *s++;
+    }
+    *d = '\0';
+}
+
+static void free_mountinfo(struct mount_t *mounts, int num)
+{
+    for (int i = 0; i < num; ++i)
+    {
+        free(mounts[i].path);
+        free(mounts[i].fstype);
+    }
+    free(mounts);
+}
+
+static unsigned long mount_flags(const char *opts)
+{
+    /* Remount resets per-mount flags it is not given, so the ones in effect are passed along */
+    static const struct { const char *name; unsigned long flag; } known[] =
+    {
+        { "nosuid", MS_NOSUID }, { "nodev", MS_NODEV }, { "noexec", MS_NOEXEC }, { "noatime", MS_NOATIME }, { "nodiratime", MS_NODIRATIME }, { "relatime", MS_RELATIME },
+    };
+    unsigned long flags = 0;
+    while (*opts)
+    {
+        size_t len = strcspn(opts, ",");
+        for (int i = 0; i < sizeof(known) / sizeof(known[0]); ++i) if (strlen(known[i].name) == len && !strncmp(opts, known[i].name, len)) flags |= known[i].flag;
+        opts += len;
+        if (*opts == ',') ++opts;
+    }
+    return flags;
+}
+
+static int read_mountinfo(struct mount_t **out)
+{
+    char infofile[PATH_MAX];
+    FILE *f = fopen(root_path(infofile, proc_root, "/self/mountinfo"), "r");
+    if (f == NULL) cancel(C_MOUNTINFO_OPEN, "Can't open %s: %s\n", infofile, strerror(errno));
+
+    struct mount_t *mounts = NULL;
+    int num = 0, alloc = 0;
+    char *line = NULL;
+    size_t linesize = 0;
+    while (getline(&line, &linesize, f) != -1)
+    {
+        /* id parent major:minor root mountpoint options [optional fields...] - fstype source superoptions */
+        int id, parent;
+        unsigned int ma, mi;
+        char *root, *path, *opts, *sep, *fstype;
+        if (sscanf(line, "%d %d %u:%u", &id, &parent, &ma, &mi) != 4 || strtok(line, " ") == NULL || strtok(NULL, " ") == NULL || strtok(NULL, " ") == NULL ||
+            (root = strtok(NULL, " ")) == NULL || (path = strtok(NULL, " ")) == NULL || (opts = strtok(NULL, " ")) == NULL)
+        {
+            free(line); fclose(f); free_mountinfo(mounts, num);
+            cancel(C_MOUNTINFO_PARSE, "Can't parse %s\n", infofile);
+        }
+        while ((sep = strtok(NULL, " ")) != NULL && strcmp(sep, "-"));
+        if (sep == NULL || (fstype = strtok(NULL, " ")) == NULL)
+        {
+            free(line); fclose(f); free_mountinfo(mounts, num);
+            cancel(C_MOUNTINFO_PARSE, "Can't parse %s\n", infofile);
+        }
+
+        if (num == alloc)
+        {
+            alloc = alloc ? alloc * 2 : 32;
+            struct mount_t *newmounts = realloc(mounts, alloc * sizeof(*mounts));
+            if (newmounts == NULL) { free(line); fclose(f); free_mountinfo(mounts, num); cancel(C_MOUNTINFO_ALLOC, "Can't allocate memory for mount list\n"); }
+            mounts = newmounts;
+        }
+        unescape_mountinfo(path);
+        struct mount_t *m = &mounts[num];
+        memset(m, 0, sizeof(*m));
+        m->id = id;
+        m->parent = parent;
+        m->dev = makedev(ma, mi);
+        m->rw = !strncmp(opts, "rw", 2) && (opts[2] == ',' || opts[2] == '\0');
+        m->mflags = mount_flags(opts);
+        m->path = strdup(path);
+        m->fstype = strdup(fstype);
+        if (m->path == NULL || m->fstype == NULL) { free(line); fclose(f); free_mountinfo(mounts, num + 1); cancel(C_MOUNTINFO_ALLOC, "Can't allocate memory for mount list\n"); }
+        ++num;
+    }
+    free(line);
+    fclose(f);
+    *out = mounts;
+    return num;
+}
+
+static int is_virtual_fs(const char *fstype)
+{
+    /* Filesystems having nothing to write back */
+    static const char *virtual_fs[] = { "proc", "sysfs", "devtmpfs", "devpts", "tmpfs", "ramfs", "cgroup", "cgroup2", "securityfs", "debugfs", "tracefs",
+                                        "pstore", "bpf", "mqueue", "hugetlbfs", "configfs", "fusectl", "autofs", "binfmt_misc", "efivarfs", "rpc_pipefs", NULL };
+    for (int i = 0; virtual_fs[i]; ++i) if (!strcmp(fstype, virtual_fs[i])) return 1;
+    return 0;
+}
+
+#define MAX_REMOUNT_THREADS 8
+
+struct remount_t
+{
+    struct mount_t *mounts;
+    int num;
+    int *parent;    /* index of mount this one is mounted on, -1 if it is not in the list */
+    int *pending;   /* mounts on this one not done yet */
+    int *order;     /* ready to go in order[taken..ready), done in order[0..done) */
+    int taken;
+    int ready;
+    int done;
+    int freeze;
+    int dry;
+    int freezing;   /* freezes in flight */
+    int thawing;    /* remount is given up, freezes are to be undone */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+struct frozen_t
+{
+    int fd;
+    char *path;
+};
+static struct frozen_t *frozen; /* filesystems frozen by remount_targeted(), to be thawed if reboot does not happen */
+static int frozen_num;
+
+static void thaw_one(int fd, const char *path)
+{
+    if (ioctl(fd, FITHAW, 0) == -1) printf("Can't thaw %s: %s\n", path, strerror(errno));
+    else printf("Thawed %s.\n", path);
+    close(fd);
+}
+
+static void thaw_filesystems(void)
+{
+    for (int i = frozen_num - 1; i >= 0; --i)
+    {
+        thaw_one(frozen[i].fd, frozen[i].path);
+        free(frozen[i].path);
+    }
+    free(frozen);
+    frozen = NULL;
+    frozen_num = 0;
+}
+
+static int freeze_one(struct remount_t *r, struct mount_t *m)
+{
+    /* Freeze in flight is recorded, so that remount_targeted() giving up waits for it; one that completes
+       after that is undone right here. Returns 1 if filesystem is frozen or remount is given up */
+    int fd = open(m->path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) return 0;
+    pthread_mutex_lock(&r->lock);
+    int thawing = r->thawing;
+    if (!thawing) { m->freeze_fd = fd; ++r->freezing; }
+    pthread_mutex_unlock(&r->lock);
+    if (thawing) { close(fd); return 1; }
+
+    int e = ioctl(fd, FIFREEZE, 0);
+    pthread_mutex_lock(&r->lock);
+    thawing = r->thawing;
+    if (e == 0 && !thawing) m->frozen = 1;
+    pthread_mutex_unlock(&r->lock);
+    if (e == 0 && thawing) thaw_one(fd, m->path);
+    else if (e != 0) close(fd);
+
+    pthread_mutex_lock(&r->lock);
+    --r->freezing;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    return e == 0 || thawing;
+}
+
+static void remount_one(struct remount_t *r, struct mount_t *m)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    /* Filesystems not supporting freeze, or failing to, are remounted instead */
+    if (!(r->freeze && freeze_one(r, m)) && mount(NULL, m->path, NULL, MS_REMOUNT | MS_RDONLY | m->mflags, NULL) == -1) m->remount_err = errno;
+    m->remount_ms = elapsed_since(&start);
+}
+
+static void *remount_worker(void *arg)
+{
+    /* Mount is taken once everything mounted on it is done, so independent subtrees go in parallel */
+    struct remount_t *r = arg;
+    int *order = r->order;
+    pthread_mutex_lock(&r->lock);
+    for (;;)
+    {
+        while (r->taken == r->ready && r->done < r->num) pthread_cond_wait(&r->cond, &r->lock);
+        if (r->taken == r->ready) break;
+        int n = order[r->taken++];
+        pthread_mutex_unlock(&r->lock);
+
+        if (r->mounts[n].todo && !r->dry) remount_one(r, &r->mounts[n]);
+
+        pthread_mutex_lock(&r->lock);
+        /* Done ones are moved to the front, so order[] ends up in the order of completion */
+        int pos = r->done++;
+        for (int i = r->taken - 1; i > pos; --i) if (order[i] == n) { order[i] = order[pos]; order[pos] = n; break; }
+        int p = r->parent[n];
+        if (p != -1 && --r->pending[p] == 0) order[r->ready++] = p;
+        pthread_cond_broadcast(&r->cond);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+static void remount_targeted(int timeout, int freeze)
+{
+    /* Each writable filesystem is remounted read-only (or frozen) by itself, after everything mounted on it; emergency remount is left as a fallback */
+    struct remount_t r;
+    r.num = read_mountinfo(&r.mounts);
+    r.freeze = freeze;
+    r.dry = strcmp(proc_root, "/proc") != 0;
+    r.taken = r.ready = r.done = 0;
+    r.freezing = r.thawing = 0;
+    int *ints = malloc(3 * r.num * sizeof(int) + 1);
+    if (ints == NULL) { free_mountinfo(r.mounts, r.num); cancel(C_REMOUNT_ALLOC, "Can't allocate memory to remount %d filesystems\n", r.num); }
+    r.parent = ints;
+    r.pending = ints + r.num;
+    r.order = ints + 2 * r.num;
+
+    int todo_num = 0;
+    for (int i = 0; i < r.num; ++i)
+    {
+        struct mount_t *m = &r.mounts[i];
+        r.parent[i] = -1;
+        r.pending[i] = 0;
+        for (int j = 0; j < r.num; ++j) if (j != i && r.mounts[j].id == m->parent) r.parent[i] = j;
+        m->todo = m->rw && !is_virtual_fs(m->fstype);
+        for (int j = 0; m->todo && j < i; ++j) if (r.mounts[j].todo && r.mounts[j].dev == m->dev) m->todo = 0;
+        todo_num += m->todo;
+    }
+    for (int i = 0; i < r.num; ++i) if (r.parent[i] != -1) ++r.pending[r.parent[i]];
+    for (int i = 0; i < r.num; ++i) if (r.pending[i] == 0) r.order[r.ready++] = i;
+    if (r.dry) printf("Mount table is not of this system (--proc-root is given), so filesystems are not actually remounted.\n");
+
+    pthread_mutex_init(&r.lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&r.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int threads_num = (todo_num > MAX_REMOUNT_THREADS) ? MAX_REMOUNT_THREADS : (todo_num ? todo_num : 1);
+    pthread_t threads[threads_num];
+    for (int i = 0; i < threads_num; ++i)
+    {
+        int e = pthread_create(&threads[i], NULL, remount_worker, &r);
+        if (e) cancel(C_REMOUNT_THREAD, "Can't start filesystem remount thread: %s\n", strerror(e));
+    }
+
+    /* Remount may hang on a stuck device; then there is nothing to do but give up */
+    struct timespec deadline = start;
+    deadline.tv_sec += timeout;
+    pthread_mutex_lock(&r.lock);
+    while (r.done < r.num)
+    {
+        if (!timeout) pthread_cond_wait(&r.cond, &r.lock);
+        else if (pthread_cond_timedwait(&r.cond, &r.lock, &deadline) == ETIMEDOUT && r.done < r.num)
+        {
+            /* System is not rebooted, so it must not be left frozen: frozen filesystems are thawed here, and those
+               still being frozen by workers are waited for and thawed by them. Remounts in flight are left as they go */
+            r.thawing = 1;
+            for (int i = 0; i < r.num; ++i) if (r.mounts[i].frozen) thaw_one(r.mounts[i].freeze_fd, r.mounts[i].path);
+            if (r.freezing) printf("Waiting for %d filesystems being frozen, to thaw them.\n", r.freezing);
+            while (r.freezing) pthread_cond_wait(&r.cond, &r.lock);
+            cancel(C_REMOUNT_TIMEOUT, "Read-only remount of filesystems did not complete in %d seconds\n", timeout);
+        }
+    }
+    pthread_mutex_unlock(&r.lock);
+    for (int i = 0; i < threads_num; ++i) pthread_join(threads[i], NULL);
+    pthread_cond_destroy(&r.cond);
+    pthread_mutex_destroy(&r.lock);
+
+    int failed = 0;
+    if (freeze && !r.dry) frozen = malloc(todo_num * sizeof(*frozen) + 1);
+    for (int i = 0; i < r.num; ++i)
+    {
+        struct mount_t *m = &r.mounts[r.order[i]];
+        if (!m->todo) continue;
+        if (r.dry) printf("Would remount %s (%s) read-only.\n", m->path, m->fstype);
+        else if (m->frozen) printf("Froze %s (%s) in %.3f ms.\n", m->path, m->fstype, m->remount_ms);
+        else if (m->remount_err) printf("Can't remount %s (%s) read-only: %s\n", m->path, m->fstype, strerror(m->remount_err));
+        else printf("Remounted %s (%s) read-only in %.3f ms.\n", m->path, m->fstype, m->remount_ms);
+        failed += (m->remount_err != 0);
+        if (m->frozen && frozen != NULL)
+        {
+            /* Path is handed over from mount list */
+            frozen[frozen_num].fd = m->freeze_fd;
+            frozen[frozen_num++].path = m->path;
+            m->path = NULL;
+        }
+        else if (m->frozen) thaw_one(m->freeze_fd, m->path);
+    }
+    printf("%d filesystems done in %.3f ms using %d threads.\n", todo_num, elapsed_since(&start), threads_num);
+    free(ints);
+    free_mountinfo(r.mounts, r.num);
+
+    if (failed)
+    {
+        printf("%d filesystems could not be remounted read-only, falling back to emergency remount.\n", failed);
+        thaw_filesystems(); /* emergency remount would hang on them */
+        remount_filesystems(timeout);
+    }
+}
+
+static void *flush_worker(void *arg)
+{
+    struct flush_t *fl = arg;
+    for (;;)
+    {
+        pthread_mutex_lock(&fl->lock);
+        int n = fl->next++;
+        pthread_mutex_unlock(&fl->lock);
+        if (n >= fl->mounts_num) return NULL;
+
+        struct mount_t *m = &fl->mounts[n];
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int fd = open(m->path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd == -1 || syncfs(fd) == -1) m->flush_err = errno;
+        if (fd != -1) close(fd);
+        m->flush_ms = elapsed_since(&start);
+    }
+}
+
+static void start_flush(struct flush_t *fl)
+{
+    /* Write back each writable filesystem on its own, in background, while image is loaded and video is reset */
+    struct mount_t *mounts;
+    int num = read_mountinfo(&mounts);
+    fl->mounts_num = 0;
+    for (int i = 0; i < num; ++i)
+    {
+        int dup = 0;
+        for (int j = 0; j < fl->mounts_num; ++j) if (mounts[j].dev == mounts[i].dev) dup = 1;
+        if (!mounts[i].rw || dup || is_virtual_fs(mounts[i].fstype))
+        {
+            free(mounts[i].path);
+            free(mounts[i].fstype);
+            continue;
+        }
+        mounts[fl->mounts_num++] = mounts[i];
+    }
+    fl->mounts = mounts;
+    fl->next = 0;
+    pthread_mutex_init(&fl->lock, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &fl->start);
+
+    fl->workers_num = 0;
+    while (fl->workers_num < FLUSH_WORKERS && fl->workers_num < fl->mounts_num)
+    {
+        int e = pthread_create(&fl->workers[fl->workers_num], NULL, flush_worker, fl);
+        if (e) cancel(C_FLUSH_THREAD, "Can't start filesystem flush thread: %s\n", strerror(e));
+        ++fl->workers_num;
+    }
+    printf("Started flushing %d writable filesystems in background.\n", fl->mounts_num);
+}
+
+static void finish_flush(struct flush_t *fl)
+{
+    for (int i = 0; i < fl->workers_num; ++i) pthread_join(fl->workers[i], NULL);
+    for (int i = 0; i < fl->mounts_num; ++i)
+    {
+        struct mount_t *m = &fl->mounts[i];
+        if (m->flush_err) printf("Can't flush %s (%s): %s\n", m->path, m->fstype, strerror(m->flush_err));
+        else printf("Flushed %s (%s) in %.3f ms.\n", m->path, m->fstype, m->flush_ms);
+    }
+    printf("Filesystems flushed in %.3f ms since start.\n", elapsed_since(&fl->start));
+    pthread_mutex_destroy(&fl->lock);
+}
+
+static void free_flush(struct flush_t *fl)
+{
+    free_mountinfo(fl->mounts, fl->mounts_num);
+    fl->mounts = NULL;
+    fl->mounts_num = 0;
+}
+
+static void json_string(FILE *f, const char *str)
+{
+    fputc('"', f);
+    for (const unsigned char *p = (const unsigned char *)str; *p; ++p)
+    {
+        if (*p == '"' || *p == '\\') fprintf(f, "\\%c", *p);
+        else if (*p < 0x20) fprintf(f, "\\u%04x", *p);
+        else fputc(*p, f);
+    }
+    fputc('"', f);
+}
+
+static void write_report(const char *file, const struct flush_t *fl, int before_ioctl)
+{
+    /* Report is fsync()ed here, as its filesystem may be remounted read-only right after; failing to write it is not fatal */
+    FILE *f = fopen(file, "w");
+    if (f == NULL) { printf("Can't create report file %s: %s\n", file, strerror(errno)); return; }
+    fprintf(f, "{\n  \"version\": ");
+    json_string(f, PROJ_VER);
+    fprintf(f, ",\n  \"elapsed_ms\": %.3f,\n", elapsed_since(&run_start));
+    if (before_ioctl) fprintf(f, "  \"ioctl_entry_ms\": %.3f,\n", elapsed_since(&run_start));
+    fprintf(f, "  \"phases\": [");
+    for (int i = 0; i < phases_num; ++i)
+    {
+        fprintf(f, "%s\n    { \"name\": ", i ? "," : "");
+        json_string(f, phases[i].name);
+        fprintf(f, ", \"start_ms\": %.3f, \"ms\": %.3f", (phases[i].start.tv_sec - run_start.tv_sec) * 1e3 + (phases[i].start.tv_nsec - run_start.tv_nsec) / 1e6, phases[i].ms);
+        if (phases[i].bytes) fprintf(f, ", \"bytes\": %llu, \"mbps\": %.1f", (unsigned long long)phases[i].bytes, phases[i].ms > 0 ? phases[i].bytes / phases[i].ms / 1e3 : 0.0);
+        fprintf(f, " }");
+    }
+    fprintf(f, "\n  ],\n  \"mounts\": [");
+    for (int i = 0; fl && i < fl->mounts_num; ++i)
+    {
+        fprintf(f, "%s\n    { \"path\": ", i ? "," : "");
+        json_string(f, fl->mounts[i].path);
+        fprintf(f, ", \"fstype\": ");
+        json_string(f, fl->mounts[i].fstype);
+        fprintf(f, ", \"flush_ms\": %.3f", fl->mounts[i].flush_ms);
+        if (fl->mounts[i].flush_err) { fprintf(f, ", \"error\": "); json_string(f, strerror(fl->mounts[i].flush_err)); }
+        fprintf(f, " }");
+    }
+    fprintf(f, "\n  ]\n}\n");
+    if (fflush(f) || fsync(fileno(f))) printf("Can't write report file %s: %s\n", file, strerror(errno));
+    if (fclose(f)) printf("Can't close report file %s: %s\n", file, strerror(errno));
+    else printf("Timing report is written to %s.\n", file);
+}
+
+extern const char *vcs_ver;
+static void version(const char *argv0)
+{
+    printf("%s (kexec-e2k) version %s, git revision %s\n", argv0, PROJ_VER, vcs_ver);
+    exit(C_SUCCESS);
+}
+
+static const char *bcd_tag_names[] = { "lintel", "lintel_obj", "x86bios", "x86bios_recovery", "librcomp", "bcdbootinfo", "codebase", "log", "videobios", "kexec_jumper" };
+#define BCD_TAGS_NUM (sizeof(bcd_tag_names) / sizeof(bcd_tag_names[0]))
+
+#define BCD_TABLE_READ 65536 /* header and table of up to 2047 files are read in one go */
+
+static const char *read_bcd_table(int fd, struct xrt_BcdHeader_t *header, struct xrt_BcdFile_t **files)
+{
+    /* Returns error message, or NULL and malloc'ed table */
+    char *buf = malloc(BCD_TABLE_READ);
+    if (buf == NULL) return "out of memory";
+    ssize_t r = pread(fd, buf, BCD_TABLE_READ, 512);
+    if (r == -1) { free(buf); return strerror(errno); }
+    if (r < sizeof(*header)) { free(buf); return "file is too short"; }
+    memcpy(header, buf, sizeof(*header));
+    if (header->signature != LINTEL_BCD_SIGNATURE) { free(buf); return "not a BCD file"; }
+    if (header->files_num > MAX_BCD_FILES) { free(buf); return "file table is too large"; }
+
+    size_t tablesize = sizeof(*header) + header->files_num * sizeof(struct xrt_BcdFile_t);
+    if (tablesize > r)
+    {
+        /* Unusually large table: read the rest of it */
+        char *newbuf = realloc(buf, tablesize);
+        if (newbuf == NULL) { free(buf); return "out of memory"; }
+        buf = newbuf;
+        ssize_t rest = pread(fd, buf + r, tablesize - r, 512 + r);
+        if (rest == -1) { free(buf); return strerror(errno); }
+        if (rest != tablesize - r) { free(buf); return "file table is truncated"; }
+    }
+    memmove(buf, buf + sizeof(*header), tablesize - sizeof(*header));
+    *files = (struct xrt_BcdFile_t *)buf;
+    return NULL;
+}
+
+static int open_bcd(const char *fname, int *fd, struct xrt_BcdHeader_t *header, struct xrt_BcdFile_t **files, const char **err)
+{
+    *fd = strcmp(fname, "-") ? open(fname, O_RDONLY) : dup(STDIN_FILENO);
+    if (*fd == -1) { *err = strerror(errno); return -1; }
+    /* Table and files are read at their offsets, so standard input may be a redirected file, but not a pipe */
+    struct stat st;
+    if (fstat(*fd, &st) == -1) { *err = strerror(errno); close(*fd); return -1; }
+    if (!S_ISREG(st.st_mode) && !S_ISBLK(st.st_mode)) { *err = "not a regular file or block device (BCD files can't be listed or extracted from a pipe)"; close(*fd); return -1; }
+    posix_fadvise(*fd, 0, 0, POSIX_FADV_RANDOM);
+    if ((*err = read_bcd_table(*fd, header, files))) { close(*fd); return -1; }
+    return 0;
+}
+
+static void list_bcd(const char *fname, int format, int *first, int *failed)
+{
+    int fd;
+    struct xrt_BcdHeader_t header;
+    struct xrt_BcdFile_t *files;
+    const char *err;
+    int rv = open_bcd(fname, &fd, &header, &files, &err);
+
+    if (format == LIST_JSON)
+    {
+        printf("%s\n  {\"path\": ", *first ? "" : ",");
+        json_string(stdout, fname);
+    }
+    *first = 0;
+    if (rv)
+    {
+        *failed = 1;
+        if (format == LIST_JSON) { printf(", \"error\": "); json_string(stdout, err); printf("}"); }
+        else printf("%s: %s\n", fname, err);
+        return;
+    }
+    close(fd);
+
+    if (format == LIST_JSON)
+    {
+        printf(", \"files_num\": %u, \"free_lba\": %lu, \"files\": [", header.files_num, header.free_lba);
+        for (uint32_t i = 0; i < header.files_num; ++i)
+        {
+            printf("%s\n    {\"index\": %u, \"tag\": %u, ", i ? "," : "", i, files[i].tag);
+            if (files[i].tag < BCD_TAGS_NUM) printf("\"name\": \"%s\", ", bcd_tag_names[files[i].tag]);
+            printf("\"lba\": %lu, \"size\": %lu, \"init_size\": %lu, \"checksum\": %u}", files[i].lba, files[i].size, files[i].init_size, files[i].checksum);
+        }
+        printf("%s]}", header.files_num ? "\n  " : "");
+    }
+    else
+    {
+        printf("%s: BCD container, %u files, free LBA %lu\n", fname, header.files_num, header.free_lba);
+        printf("  %5s  %-18s %12s %12s %12s  %s\n", "INDEX", "TAG", "LBA", "SIZE", "INIT_SIZE", "CHECKSUM");
+        for (uint32_t i = 0; i < header.files_num; ++i)
+        {
+            char tag[32];
+            if (files[i].tag < BCD_TAGS_NUM) snprintf(tag, sizeof(tag), "%s", bcd_tag_names[files[i].tag]);
+            else snprintf(tag, sizeof(tag), "/%u", files[i].tag);
+            printf("  %5u  %-18s %12lu %12lu %12lu  0x%08x\n", i, tag, files[i].lba, files[i].size, files[i].init_size, files[i].checksum);
+        }
+    }
+    free(files);
+}
+
+#ifdef NO_COPY_FILE_RANGE
+static ssize_t copy_file_range(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len, unsigned int flags)
+{
+#ifdef SYS_copy_file_range
+    return syscall(SYS_copy_file_range, fd_in, off_in, fd_out, off_out, len, flags);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+#endif
+
+static int copy_range(int in, int out, off_t offset, size_t size)
+{
+    /* Data goes file to file in kernel (or even is shared by filesystem); sendfile() covers pipes and cross-filesystem copies of older kernels */
+    loff_t off = offset;
+    int use_sendfile = 0;
+    while (size)
+    {
+        ssize_t r;
+        if (!use_sendfile)
+        {
+            r = copy_file_range(in, &off, out, NULL, size, 0);
+            if (r == -1 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP || errno == EBADF)) { use_sendfile = 1; continue; }
+        }
+        else
+        {
+            off_t soff = off;
+            r = sendfile(out, in, &soff, size);
+            off = soff;
+        }
+        if (r == -1 && errno == EINTR) continue;
+        if (r == -1) return -1;
+        if (r == 0) { errno = ENODATA; return -1; }
+        size -= r;
+    }
+    return 0;
+}
+
+static void extract_bcd(const char *fname, const struct flags_t *flags)
+{
+    int fd;
+    struct xrt_BcdHeader_t header;
+    struct xrt_BcdFile_t *files;
+    const char *err;
+    if (open_bcd(fname, &fd, &header, &files, &err)) cancel(C_INSPECT, "%s: %s\n", fname, err);
+    int quiet = 0; /* Don't mix messages into extracted data */
+    for (int i = 0; i < flags->extract_num; ++i) if (!strcmp(strchr(flags->extract[i], '=') + 1, "-")) quiet = 1;
+
+    for (int i = 0; i < flags->extract_num; ++i)
+    {
+        /* TAG is either a name, or a number, which is taken as a tag itself (not an index in table) */
+        const char *spec = flags->extract[i];
+        const char *out = strchr(spec, '=') + 1;
+        char *endp;
+        unsigned long tag = strtoul(spec, &endp, 0);
+        if (endp == spec || *endp != '=')
+        {
+            for (tag = 0; tag < BCD_TAGS_NUM; ++tag) if (!strncmp(spec, bcd_tag_names[tag], out - spec - 1) && bcd_tag_names[tag][out - spec - 1] == '\0') break;
+            if (tag == BCD_TAGS_NUM) { free(files); close(fd); cancel(C_EXTRACT_TAG, "%s: unknown BCD file tag name %.*s\n", fname, (int)(out - spec - 1), spec); }
+        }
+        uint32_t n;
+        for (n = 0; n < header.files_num; ++n) if (files[n].tag == tag) break;
+        if (n == header.files_num) { free(files); close(fd); cancel(C_EXTRACT_TAG, "%s: no file with tag %.*s in BCD file\n", fname, (int)(out - spec - 1), spec); }
+
+        struct xrt_BcdFile_t file = files[n];
+        if (file.lba > INT64_MAX / 512 || file.size > INT64_MAX / 512 - file.lba)
+        {
+            /* Byte offset would wrap around and point at some other data */
+            free(files);
+            close(fd);
+            cancel(C_EXTRACT_WRITE, "%s: BCD file /%u (%lu blocks at block %lu) lies outside of any file\n", fname, file.tag, file.size, file.lba);
+        }
+        int ofd = strcmp(out, "-") ? open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644) : dup(STDOUT_FILENO);
+        if (ofd == -1) { int e = errno; free(files); close(fd); cancel(C_EXTRACT_WRITE, "Can't open %s: %s\n", out, strerror(e)); }
+        if (copy_range(fd, ofd, 512 * file.lba, 512 * file.size) || close(ofd))
+        {
+            int e = errno;
+            free(files);
+            close(fd);
+            cancel(C_EXTRACT_WRITE, "Can't extract BCD file /%u (%lu blocks at block %lu) to %s: %s\n", file.tag, file.size, file.lba, out, (e == ENODATA) ? "BCD file is truncated" : strerror(e));
+        }
+        if (!quiet) printf("Extracted BCD file /%u (%lu bytes) to %s\n", file.tag, 512 * file.size, out);
+    }
+    free(files);
+    close(fd);
+}
+
+static void inspect(int argc, char * const argv[], const char *fname, const struct flags_t *flags)
+{
+    /* Only reads image files; nothing in the system is checked or changed */
+    if (flags->extract_num)
+    {
+        if (optind + 1 < argc) cancel(C_OPTARG_TOOMANY, "%s: specified multiple files to extract from, only a single one is expected\nRun %s --help for usage)\n", argv[0], argv[0]);
+        extract_bcd(fname, flags);
+        exit(C_SUCCESS);
+    }
+
+    /* Any number of files or patterns may be listed */
+    int first = 1, failed = 0;
+    if (flags->list == LIST_JSON) printf("[");
+    for (int i = (optind < argc) ? optind : -1; i < argc; ++i)
+    {
+        const char *pattern = (i == -1) ? fname : argv[i];
+        glob_t globbuf;
+        if (!strcmp(pattern, "-") || glob(pattern, GLOB_ERR | GLOB_TILDE | GLOB_NOCHECK, NULL, &globbuf))
+        {
+            list_bcd(pattern, flags->list, &first, &failed);
+        }
+        else
+        {
+            for (size_t j = 0; j < globbuf.gl_pathc; ++j) list_bcd(globbuf.gl_pathv[j], flags->list, &first, &failed);
+            globfree(&globbuf);
+        }
+        if (i == -1) break;
+    }
+    if (flags->list == LIST_JSON) printf("\n]\n");
+    exit(failed ? C_INSPECT : C_SUCCESS);
+}
+
+static void usage(const char *argv0, const char *def)
+{
+    printf("Usage:\n");
+    printf("    %s [OPTIONS] [FILE]\n\n", argv0);
+    printf("    FILE:             File to start (may be a plain lintel starter or kernel image, lintel BCD image, or a lintel BCD image with kexec jumper)\n");
+    printf("                      Wildcards are supported (to prevent shell expansion, put the argument in quotes). Only one file should fit the pattern then.\n");
+    printf("                      If not specified, %s is loaded. Use a single dash to load a file from standard input\n", def);
+    printf("                      May be a disk holding lintel BCD image (e.g. /dev/sda), or `auto' to find such disk among all SATA and NVMe disks\n");
+    printf("    OPTIONS:\n");
+    printf("        --version:    Show version and exit\n");
+    printf("        --no-mmap:    Read image files into memory instead of mapping them\n");
+    printf("        --cache=DIR:  Keep prepared payloads in DIR (preferably on tmpfs) and reuse them when image files did not change\n");
+    printf("        --no-decompress: Don't decompress gzip, zstd or xz compressed image files, but load them as is\n");
+    printf("        --no-bg-load: Don't load image in background while checking the system, load it after checks instead\n");
+    printf("        --list[=table|json]: List contents of BCD files (any number of FILE arguments may be given) and exit\n");
+    printf("        --extract=TAG=FILE: Write BCD file with TAG (a number, or a name like lintel, x86bios, log, videobios, kexec_jumper) to FILE (- for standard output) and exit; may be repeated\n");
+    printf("        --scan:       If FILE has no BCD header at its start, look for BCD container in its MBR or GPT partitions, or anywhere in it\n");
+    printf("        --direct:     Read image and initrd files (or block devices) with direct I/O, bypassing page cache\n");
+    printf("        --strip-elf:  If kernel image is an ELF file, load only its headers and loadable segments, leaving out debug info and symbols\n");
+    printf("        --huge-threshold=N: Load images of N MiB or more into huge pages (default 64)\n");
+    printf("        --io-depth=N: Keep up to N reads of 1 MiB in flight with io_uring when reading images (default 16; 0 to read with plain pread())\n");
+    printf("        --no-hugepages: Never load images into huge pages\n");
+    printf("        --no-mlock:   Don't lock loaded images in memory until reboot\n");
+    printf("        --display-servers=LIST: Comma-separated list of display server executables that should not be running (default: %s)\n", DEFAULT_FLAGS.xservers);
+    printf("        --daemon=SOCKET: Prepare image, then wait for status, reload or go command on unix socket SOCKET; check the system and reboot on go\n");
+    printf("        --bench-load=N: Don't boot anything, but prepare image N times with cold and N times with warm page cache for each way of reading files, and report timings\n");
+    printf("        --report=FILE: Write timings of all phases to FILE in JSON format (written before filesystems are remounted read-only)\n");
+    printf("        --sys-root=DIR, --proc-root=DIR, --dev-root=DIR: Look for sysfs, procfs and devices in DIR instead of /sys, /proc and /dev\n");
+    printf("                      (if kexec device found there is not a character device, kexec parameters are checked and written to it instead of rebooting;\n");
+    printf("                      if framebuffer device is not, it holds the number of framebuffer consoles are mapped to; mountpoints are not checked)\n");
+    printf("        --remount-timeout=N: Fail if emergency remount of filesystems does not complete in N seconds (default 60, 0 to wait forever)\n");
+    printf("        --remount=sysrq|targeted: Remount filesystems read-only with emergency remount (default), or one by one in mount tree order, in parallel, falling back to emergency remount on failure\n");
+    printf("        --freeze:     Freeze filesystems that support it instead of remounting them read-only (implies --remount=targeted)\n");
+    printf("        -h | --help:  Show this help and exit\n");
+    printf("        -t | --tty N: Reset framebuffer device associated with ttyN instead of currently active one (has no effect if -b, or both -M and -P are given)\n");
+    printf("        -e N:         Allow only N network adapters\n");
+    printf("        -E TYPE:      Set network adapter type to TYPE (supported types: `Intel', `PCNet', `Elbrus')\n");
+    printf("        -m:           Don't check for unmounted filesystems and don't mount them\n");
+    printf("        -i:           Ignored (for backwards compatibility)\n");
+    printf("        -r:           Don't check current runlevel\n");
+    printf("        -X:           Don't check if X or another display server is started\n");
+    printf("        -b:           Don't reset current framebuffer device\n");
+    printf("        -f:           Don't sync, flush, and remount-read-only filesystems\n");
+    printf("        -V:           Don't unbind currently active vtconsole (has no effect if -b is given)\n");
+    printf("        -M:           Don't unload module bound to PCI Express device implementing current framebuffer (has no effect if -b is given)\n");
+    printf("        -P:           Don't remove PCI Express device implementing current framebuffer (has no effect if -b is given)\n");
+    printf("        -B:           Ignored (for backwards compatibility)\n");
+    printf("        -x:           Don't perform actual kexec or kexec_lintel ioctl but everything preceeding it\n");
+    printf("When starting kernel image:\n");
+    printf("        -I FILE:      Use FILE as initrd image (no initrd image is passed if not specified); may be repeated to pass several files concatenated\n");
+    printf("        -c CMDLINE:   Pass CMDLINE as new kernel command line (one of currently loaded kernel is passed if neither -c nor -a specified)\n");
+    printf("        -a CMDLINE:   Add CMDLINE to one of currently loaded kernel to produce new kernel command line\n");
+    printf("When starting lintel image:\n");
+    printf("        -l:           Treat non-BCD file as a lintel starter, not kernel image\n");
+    printf("        -d DEVNAME:   Avoid asking for boot drive and boot guest OS from DEVNAME (e.g. /dev/sdc) by default\n");
+    printf("        -N FILE:      Use FILE as NVRAM image (if not specified, lintel will read actual NVRAM). Create it by calling dd if=/dev/nvram of=FILE bs=256 skip=1 count=3\n");
+    printf("        -T:           Prohibit lintel to react at any keypress to perform a controlled trusted boot (has an effect only if -d is given)\n");
+    printf("        -n:           Don't check that boot disk AHCI controller is on node 0 (has an effect only if -d is given)\n");
+    printf("        -v:           Don't pass current video adapter id to lintel and make it load on the one it has in NVRAM\n");
+    exit(C_SUCCESS);
+}
+
+static const char *long_value(const char *opt, const char *name)
+{
+    size_t l = strlen(name);
+    return (!strncmp(opt, name, l) && opt[l] == '=') ? opt + l + 1 : NULL;
+}
+
+static const char *check_args(int argc, char * const argv[], const char *def, int *tty, struct flags_t *flags, dev_t *disk, char cmdline[], char initrd[])
+{
+    int is_nvram = 0;
+    for(;;)
+    {
+        int opt = getopt(argc, argv, "h-:t:d:I:N:c:a:e:E:TnmlirbfvVMPBXx");
+        if(opt == -1)
+        {
+            if (optind == argc) return def;
+            if (optind + 1 == argc || flags->list) return argv[optind];
+            cancel(C_OPTARG_TOOMANY, "%s: specified multiple lintel/kernel paths, only a single one is expected\nRun %s --help for usage)\n", argv[0], argv[0]);
+        }
+
         char *endp;
+        const char *val;
         switch(opt)
         {
             case 'T':
@@ -1185,6 +4241,12 @@ static const char *check_args(int argc, char * const argv[], const char *def, in
             case 'I':
                 flags->noinitrd = 0;
                 if(strlen(optarg) >= PATH_MAX) cancel(C_LINUX_INITRD_LONG, "%s: passed %s path is longer than %d bytes\n", argv[0], (is_nvram ? "NVRAM" : "initrd"), PATH_MAX);
+                if(opt == 'I')
+                {
+                    if(flags->initrds_num == MAX_INITRDS) cancel(C_LINUX_INITRD_MANY, "%s: too many initrd files, up to %d are supported\n", argv[0], MAX_INITRDS);
+                    flags->initrds[flags->initrds_num++] = optarg;
+                    if(flags->initrds_num > 1) break;
+                }
                 strcpy(initrd, optarg);
                 break;
 
@@ -1197,6 +4259,91 @@ static const char *check_args(int argc, char * const argv[], const char *def, in
             case '-':
                 if(!strcmp(optarg, "help")) usage(argv[0], def);
                 if(!strcmp(optarg, "version")) version(argv[0]);
+                if(!strcmp(optarg, "no-mmap")) { flags->mmap = 0; break; }
+                if(!strcmp(optarg, "no-bg-load")) { flags->bgload = 0; break; }
+                if(!strcmp(optarg, "no-decompress")) { flags->decompress = 0; break; }
+                if(!strcmp(optarg, "no-hugepages")) { use_hugepages = 0; break; }
+                if(!strcmp(optarg, "no-mlock")) { lock_images = 0; break; }
+                if(!strcmp(optarg, "direct")) { flags->direct = 1; break; }
+                if(!strcmp(optarg, "scan")) { flags->scan = 1; break; }
+                if(!strcmp(optarg, "strip-elf")) { flags->stripelf = 1; break; }
+                if(!strcmp(optarg, "freeze")) { flags->freeze = 1; flags->remount = REMOUNT_TARGETED; break; }
+                if((val = long_value(optarg, "remount")))
+                {
+                    if (!strcmp(val, "sysrq")) { flags->remount = REMOUNT_SYSRQ; flags->freeze = 0; break; }
+                    if (!strcmp(val, "targeted")) { flags->remount = REMOUNT_TARGETED; break; }
+                    cancel(C_OPTARG_WRONG_REMOUNT, "%s: remount method `%s' is not one of `sysrq', `targeted'\nRun %s --help for usage\n", argv[0], val, argv[0]);
+                }
+                if((val = long_value(optarg, "huge-threshold")))
+                {
+                    errno = 0;
+                    long mb = strtol(val, &endp, 0);
+                    if (errno || *endp || *val == '\0' || mb < 0 || mb > (long)(SIZE_MAX >> 20))
+                    {
+                        cancel(C_OPTARG_WRONG_THRESHOLD, "%s: malformed huge page threshold %s\nRun %s --help for usage)\n", argv[0], val, argv[0]);
+                    }
+                    huge_threshold = (size_t)mb << 20;
+                    break;
+                }
+                if((val = long_value(optarg, "display-servers"))) { flags->xservers = val; break; }
+                if((val = long_value(optarg, "io-depth")))
+                {
+                    errno = 0;
+                    long depth = strtol(val, &endp, 0);
+                    if (errno || *endp || *val == '\0' || depth < 0 || depth > MAX_IO_DEPTH)
+                    {
+                        cancel(C_OPTARG_WRONG_DEPTH, "%s: wrong I/O queue depth %s, 0 to %d expected\nRun %s --help for usage\n", argv[0], val, MAX_IO_DEPTH, argv[0]);
+                    }
+                    io_depth = depth;
+                    break;
+                }
+                if(!strcmp(optarg, "list") || !strcmp(optarg, "list=table")) { flags->list = LIST_TABLE; break; }
+                if(!strcmp(optarg, "list=json")) { flags->list = LIST_JSON; break; }
+                if((val = long_value(optarg, "extract")))
+                {
+                    const char *eq = strchr(val, '=');
+                    if (eq == NULL || eq == val || eq[1] == '\0') cancel(C_OPTARG_EXTRACT, "%s: malformed extract specification %s, TAG=FILE expected\nRun %s --help for usage\n", argv[0], val, argv[0]);
+                    if (flags->extract_num == MAX_EXTRACTS) cancel(C_OPTARG_EXTRACT, "%s: too many files to extract, up to %d are supported\n", argv[0], MAX_EXTRACTS);
+                    flags->extract[flags->extract_num++] = val;
+                    break;
+                }
+                if((val = long_value(optarg, "cache"))) { flags->cache = val; break; }
+                if((val = long_value(optarg, "sys-root"))) { sys_root = val; break; }
+                if((val = long_value(optarg, "proc-root"))) { proc_root = val; break; }
+                if((val = long_value(optarg, "dev-root"))) { dev_root = val; break; }
+                if((val = long_value(optarg, "daemon")))
+                {
+                    if (*val == '\0') cancel(C_OPTARG, "%s: option requires an argument -- '--daemon'\nRun %s --help for usage\n", argv[0], argv[0]);
+                    flags->daemon = val;
+                    break;
+                }
+                if((val = long_value(optarg, "bench-load")))
+                {
+                    errno = 0;
+                    long runs = strtol(val, &endp, 0);
+                    if (errno || *endp || *val == '\0' || runs < 1 || runs > MAX_BENCH_RUNS)
+                    {
+                        cancel(C_OPTARG_WRONG_RUNS, "%s: wrong number of benchmark runs %s, 1 to %d expected\nRun %s --help for usage\n", argv[0], val, MAX_BENCH_RUNS, argv[0]);
+                    }
+                    flags->bench = runs;
+                    break;
+                }
+                if((val = long_value(optarg, "report")))
+                {
+                    if (*val == '\0') cancel(C_OPTARG, "%s: option requires an argument -- '--report'\nRun %s --help for usage\n", argv[0], argv[0]);
+                    flags->report = val;
+                    break;
+                }
+                if((val = long_value(optarg, "remount-timeout")))
+                {
+                    errno = 0;
+                    flags->remount_timeout = strtol(val, &endp, 0);
+                    if (errno || *endp || *val == '\0' || flags->remount_timeout < 0)
+                    {
+                        cancel(C_OPTARG_WRONG_TIMEOUT, "%s: malformed remount timeout %s\nRun %s --help for usage)\n", argv[0], val, argv[0]);
+                    }
+                    break;
+                }
                 if(strcmp(optarg, "tty")) cancel(C_OPTARG_LONG, "%s: incorrect long option -- '%s'\nRun %s --help for usage\n", argv[0], optarg, argv[0]);
                 if(optind >= argc) cancel(C_OPTARG, "%s: option requires an argument -- '--tty'\nRun %s --help for usage\n", argv[0], argv[0]);
                 optarg = argv[optind++];
@@ -1212,13 +4359,57 @@ static const char *check_args(int argc, char * const argv[], const char *def, in
     }
 }
 
-static int open_kexec()
+static int open_kexec(int *fake)
 {
+    /* Anything but a character device is treated as a fake kexec device, which just records what would be passed to kernel */
     int fd;
-    if ((fd = open("/dev/kexec", O_RDONLY)) == -1) cancel(C_DEV_OPEN, "Can't open kexec device: %s\n", strerror(errno));
+    char path[PATH_MAX];
+    struct stat st;
+    root_path(path, dev_root, "/kexec");
+    *fake = (stat(path, &st) == 0 && !S_ISCHR(st.st_mode));
+    if ((fd = open(path, *fake ? (O_WRONLY | O_TRUNC) : O_RDONLY)) == -1) cancel(C_DEV_OPEN, "Can't open kexec device: %s\n", strerror(errno));
     return fd;
 }
 
+static void write_fake(int fd, const void *buf, size_t size)
+{
+    while (size)
+    {
+        ssize_t w = write(fd, buf, size);
+        if (w == -1 && errno == EINTR) continue;
+        if (w <= 0) { int e = errno; close(fd); cancel(C_DEV_FAKE_WRITE, "Can't write to fake kexec device: %s\n", strerror(e)); }
+        buf = (const char *)buf + w;
+        size -= w;
+    }
+}
+
+static void fake_ioctl(int fd, int iskernel)
+{
+    /* Validate parameters the same way the kernel would rely on them, and dump them instead of rebooting */
+    char header[128];
+    if (iskernel)
+    {
+        if (kernel.image == NULL || kernel.image_size == 0) { close(fd); cancel(C_DEV_FAKE, "Fake kexec: no kernel image passed\n"); }
+        if (kernel.initrd_size && kernel.initrd == NULL) { close(fd); cancel(C_DEV_FAKE, "Fake kexec: initrd size is set but no initrd passed\n"); }
+        if (kernel.cmdline_size < 0 || kernel.cmdline_size >= COMMAND_LINE_SIZE || kernel.cmdline_size != strlen(kernel.cmdline)) { close(fd); cancel(C_DEV_FAKE, "Fake kexec: malformed command line\n"); }
+        snprintf(header, sizeof(header), "KEXEC_REBOOT image_size=%llu initrd_size=%llu cmdline_size=%d\n", (unsigned long long)kernel.image_size, (unsigned long long)kernel.initrd_size, kernel.cmdline_size);
+        write_fake(fd, header, strlen(header));
+        write_fake(fd, kernel.cmdline, kernel.cmdline_size);
+        write_fake(fd, kernel.image, kernel.image_size);
+        if (kernel.initrd_size) write_fake(fd, kernel.initrd, kernel.initrd_size);
+    }
+    else
+    {
+        if (lintel.image == NULL || lintel.image_size == 0) { close(fd); cancel(C_DEV_FAKE, "Fake kexec: no lintel image passed\n"); }
+        if ((uintptr_t)lintel.image % alignment) { close(fd); cancel(C_DEV_FAKE, "Fake kexec: lintel image is not aligned at 0x%lx\n", alignment); }
+        snprintf(header, sizeof(header), "LINTEL_REBOOT image_size=%llu\n", (unsigned long long)lintel.image_size);
+        write_fake(fd, header, strlen(header));
+        write_fake(fd, lintel.image, lintel.image_size);
+    }
+    if (close(fd)) cancel(C_DEV_FAKE_WRITE, "Can't close fake kexec device: %s\n", strerror(errno));
+    printf("Fake kexec device: recorded %s parameters instead of rebooting.\n", iskernel ? "KEXEC_REBOOT" : "LINTEL_REBOOT");
+}
+
 static int get_dev(const char *path)
 {
     struct stat st;
@@ -1234,98 +4425,140 @@ static void try_mount(const char *src, const char *tgt)
 
 static void check_mountpoints()
 {
-    int dev_root = get_dev("/");
-    int dev_dev  = get_dev("/dev");
-    int dev_sys  = get_dev("/sys");
-    int dev_proc = get_dev("/proc");
-    if (dev_root == dev_dev)  try_mount("devtmpfs", "/dev");
-    if (dev_root == dev_sys)  try_mount("sysfs", "/sys");
-    if (dev_root == dev_proc) try_mount("proc", "/proc");
+    if (strcmp(dev_root, "/dev") || strcmp(sys_root, "/sys") || strcmp(proc_root, "/proc"))
+    {
+        /* Fixture trees are plain directories on root filesystem, and nothing should be mounted over them */
+        printf("Filesystem roots are relocated, not checking whether they are mounted.\n");
+        return;
+    }
+    int dev_rootfs = get_dev("/");
+    int dev_dev  = get_dev(dev_root);
+    int dev_sys  = get_dev(sys_root);
+    int dev_proc = get_dev(proc_root);
+    if (dev_rootfs == dev_dev)  try_mount("devtmpfs", dev_root);
+    if (dev_rootfs == dev_sys)  try_mount("sysfs", sys_root);
+    if (dev_rootfs == dev_proc) try_mount("proc", proc_root);
 }
 
-static void check_xorg()
+struct linux_dirent64
 {
-    glob_t globbuf;
-    switch(glob("/proc/[0-9]*/exe", GLOB_ERR, NULL, &globbuf))
-    {
-        case 0:
-            break;
-
-        case GLOB_NOMATCH:
-            globfree(&globbuf);
-            cancel(C_XGLOB_NONE, "Something is wrong with your /proc; probably it does't export `exe' symlink in process directory.\n");
-
-        case GLOB_NOSPACE:
-            globfree(&globbuf);
-            cancel(C_XGLOB_ALLOC, "No memory looking for running processes\n");
-
-        case GLOB_ABORTED:
-            globfree(&globbuf);
-            cancel(C_XGLOB_ABORT, "Read error looking for running processes\n");
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
 
-        default:
-            globfree(&globbuf);
-            cancel(C_XGLOB_UNEXPECTED, "Unexpected error looking for running processes, internal result: %s\n", strerror(errno));
+static int is_display_server(const char *name, const char *list, size_t maxlen)
+{
+    /* list is comma-separated; names are compared only up to maxlen characters, as `comm' is truncated */
+    size_t l = strlen(name);
+    while (*list)
+    {
+        const char *end = strchrnul(list, ',');
+        size_t n = end - list;
+        if (n > maxlen) n = maxlen;
+        if (n && n == l && !strncmp(name, list, n)) return 1;
+        list = *end ? end + 1 : end;
     }
+    return 0;
+}
 
-    for(int i = 0; i < globbuf.gl_pathc; ++i)
+static void check_xorg(const char *servers)
+{
+    /* Walk /proc with a single reused getdents64 buffer and stop at the first display server found */
+    int procfd = open(proc_root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (procfd == -1) cancel(C_XSCAN_OPEN, "Can't open %s to look for running processes: %s\n", proc_root, strerror(errno));
+
+    char buf[32768] __attribute__((aligned(8)));
+    int processes = 0;
+    for (;;)
     {
-        char lnk[PATH_MAX];
-        path_readlink(globbuf.gl_pathv[i], lnk, 1);
-        char *exe = quick_basename(lnk);
-        if (exe && *exe == 'X') cancel(C_X_RUNNING, "Possible X process is detected: %s == %s. Kill this process or use -X to skip this check.\n", globbuf.gl_pathv[i], lnk);
+        long n = syscall(SYS_getdents64, procfd, buf, sizeof(buf));
+        if (n == -1) { int e = errno; close(procfd); cancel(C_XGLOB_ABORT, "Can't read /proc looking for running processes: %s\n", strerror(e)); }
+        if (n == 0) break;
+
+        for (long pos = 0; pos < n; )
+        {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + pos);
+            pos += d->d_reclen;
+            if (d->d_name[0] < '1' || d->d_name[0] > '9') continue;
+            ++processes;
+
+            char rel[32], lnk[PATH_MAX], comm[32];
+            const char *exe = NULL;
+            snprintf(rel, sizeof(rel), "%s/exe", d->d_name);
+            ssize_t ls = readlinkat(procfd, rel, lnk, sizeof(lnk) - 1);
+            if (ls > 0)
+            {
+                lnk[ls] = '\0';
+                exe = quick_basename(lnk);
+                if (exe && is_display_server(exe, servers, PATH_MAX)) { close(procfd); cancel(C_X_RUNNING, "Display server process is detected: %s/%s/exe == %s. Kill this process or use -X to skip this check.\n", proc_root, d->d_name, lnk); }
+            }
+            else if (errno == EACCES || errno == EPERM)
+            {
+                /* Not allowed to see the executable; resort to command name */
+                snprintf(rel, sizeof(rel), "%s/comm", d->d_name);
+                int fd = openat(procfd, rel, O_RDONLY | O_CLOEXEC);
+                if (fd == -1) continue;
+                ssize_t r = read(fd, comm, sizeof(comm) - 1);
+                close(fd);
+                if (r <= 0) continue;
+                comm[r] = '\0';
+                *strchrnul(comm, '\n') = '\0';
+                if (is_display_server(comm, servers, 15)) { close(procfd); cancel(C_X_RUNNING, "Display server process is detected: %s/%s/comm == %s. Kill this process or use -X to skip this check.\n", proc_root, d->d_name, comm); }
+            }
+        }
     }
+    close(procfd);
+    if (processes == 0) cancel(C_XGLOB_NONE, "Something is wrong with your %s; probably it does't export process directories.\n", proc_root);
 }
 
-int main(int argc, char *argv[])
+static void check_system(const struct flags_t *flags)
 {
-    int tty = -1;
-    struct flags_t flags = DEFAULT_FLAGS;
-    struct kexec_info_t kexec_info;
-    dev_t disk;
-    memset(&kexec_info, 0xff, sizeof(kexec_info));
-    char cmdline[COMMAND_LINE_SIZE];
-    char initrd[PATH_MAX];
-    memset(cmdline, 0, COMMAND_LINE_SIZE);
-    memset(initrd, 0, PATH_MAX);
-    const char *fname = check_args(argc, argv, "/opt/mcst/lintel/bin/lintel_*.disk", &tty, &flags, &disk, cmdline, initrd);
-    lintel.image = NULL;
-    kernel.cmdline = kcmdline;
-    kernel.cmdline_size = 0;
-    kernel.image = NULL;
-    kernel.initrd = NULL;
-    memset(kcmdline, 0, COMMAND_LINE_SIZE);
-    atexit(free_static);
-
-    if (flags.mounts)
+    /* Conditions that must hold at the moment of reboot, not when image is prepared */
+    int ph;
+    if (flags->mounts)
     {
+        ph = phase_begin("check_mountpoints");
         check_mountpoints();
+        phase_end(ph, 0);
     }
 
-    if (flags.runlevel)
+    if (flags->runlevel)
     {
+        ph = phase_begin("check_runlevel");
         check_runlevel();
+        phase_end(ph, 0);
     }
 
-    if (flags.xorg)
+    if (flags->xorg)
     {
-        check_xorg();
+        ph = phase_begin("check_xorg");
+        check_xorg(flags->xservers);
+        phase_end(ph, 0);
     }
+}
 
-    if (!flags.defethtype)
+static void fill_kexec_info(struct kexec_info_t *kexec_info, const struct flags_t *flags, dev_t disk)
+{
+    int ph;
+    if (!flags->defethtype)
     {
-        kexec_info.eth_emul_regime = flags.ethtype;
+        kexec_info->eth_emul_regime = flags->ethtype;
     }
 
-    if (!flags.defethnum)
+    if (!flags->defethnum)
     {
-        kexec_info.eth_enabled_num = flags.ethnum;
+        kexec_info->eth_enabled_num = flags->ethnum;
     }
 
-    if (flags.setvideo)
+    if (flags->setvideo)
     {
+        ph = phase_begin("vga_arbiter");
         char *vgaarb;
-        read_sysfs("/dev/vga_arbiter", &vgaarb, NULL);
+        char vgafile[PATH_MAX];
+        read_sysfs(root_path(vgafile, dev_root, "/vga_arbiter"), &vgaarb, NULL);
         if(!strncmp(vgaarb, "invalid", 7))
         {
             printf("VGA arbiter has no idea of which video card is active, lintel will boot on the last saved one.\n");
@@ -1336,51 +4569,585 @@ int main(int argc, char *argv[])
             if (pcidev == NULL) { free(vgaarb); cancel(C_VGA_PCI, "Can't find PCI device signature in VGA arbiter response\n"); }
             pcidev += 4;
             *strchrnul(pcidev, ',') = '\0';
-            parse_pci_id("of current VGA card", pcidev, &kexec_info.vga_pci_addr_node, &kexec_info.vga_pci_addr_bus, &kexec_info.vga_pci_addr_slot, &kexec_info.vga_pci_addr_func);
-            printf("Active VGA card to boot lintel on is %04x:%02x:%02x.%x.\n", kexec_info.vga_pci_addr_node, kexec_info.vga_pci_addr_bus, kexec_info.vga_pci_addr_slot, kexec_info.vga_pci_addr_func);
+            parse_pci_id("of current VGA card", pcidev, &kexec_info->vga_pci_addr_node, &kexec_info->vga_pci_addr_bus, &kexec_info->vga_pci_addr_slot, &kexec_info->vga_pci_addr_func);
+            printf("Active VGA card to boot lintel on is %04x:%02x:%02x.%x.\n", kexec_info->vga_pci_addr_node, kexec_info->vga_pci_addr_bus, kexec_info->vga_pci_addr_slot, kexec_info->vga_pci_addr_func);
         }
         free(vgaarb);
+        phase_end(ph, 0);
     }
 
-    if (!flags.askfordisk)
+    if (!flags->askfordisk)
     {
-        fill_disk_data(&kexec_info, disk, flags.chkdisknode);
-        if (!flags.untrusted)
+        ph = phase_begin("fill_disk_data");
+        fill_disk_data(kexec_info, disk, flags->chkdisknode);
+        phase_end(ph, 0);
+        if (!flags->untrusted)
         {
-            kexec_info.interactive = 0;
+            kexec_info->interactive = 0;
         }
     }
+}
 
-    load_image(fname, initrd, cmdline, &flags, &kexec_info);
-
-    if (flags.resetfb)
+static int reboot_now(int tty, const struct flags_t *flags, struct flush_t *flush)
+{
+    /* Destructive part: everything here is done with image already prepared; flush is started by caller */
+    int ph;
+    if (flags->resetfb)
     {
         printf("Resetting video driver...\n");
-        reset_fbdriver(tty, flags);
+        ph = phase_begin("reset_fbdriver");
+        reset_fbdriver(tty, *flags);
+        phase_end(ph, 0);
     }
 
-    if (flags.fsflush)
+    if (flags->fsflush)
     {
         printf("Flushing filesystems...\n");
-        sync();
-        remount_filesystems();
+        ph = phase_begin("flush");
+        finish_flush(flush);
+        phase_end(ph, 0);
+        ph = phase_begin("sync");
+        sync(); /* Catch up with anything dirtied after per-filesystem flush */
+        phase_end(ph, 0);
+        if (flags->report) write_report(flags->report, flush, 0);
+        free_flush(flush);
+        ph = phase_begin("remount_filesystems");
+        if (flags->remount == REMOUNT_TARGETED) remount_targeted(flags->remount_timeout, flags->freeze);
+        else remount_filesystems(flags->remount_timeout);
+        phase_end(ph, 0);
+    }
+    else if (flags->report)
+    {
+        write_report(flags->report, NULL, flags->kexec);
     }
 
-    if (!flags.kexec)
+    if (!flags->kexec)
     {
         return 0;
     }
 
-    printf("Rebooting to image...\n");
-    int kexec_fd = open_kexec();
-    int rv = ioctl(kexec_fd, (flags.iskernel ? KEXEC_REBOOT : LINTEL_REBOOT), (flags.iskernel ? (void*)&kernel : (void*)&lintel));
+    printf("Rebooting to image, %.3f ms since start...\n", elapsed_since(&run_start));
+    int fake;
+    int kexec_fd = open_kexec(&fake);
+    if (fake)
+    {
+        fake_ioctl(kexec_fd, flags->iskernel);
+        return 0;
+    }
+    int rv = ioctl(kexec_fd, (flags->iskernel ? KEXEC_REBOOT : LINTEL_REBOOT), (flags->iskernel ? (void*)&kernel : (void*)&lintel));
     int err = errno;
     close(kexec_fd);
+    thaw_filesystems();
     cancel(C_DEV_IOCTL, "Failure performing ioctl (returned %d) to start image: %s\n", rv, strerror(err));
 
-    if (flags.fsflush)
+    if (flags->fsflush)
     {
         printf("Note: you should at least remount everything back to rw to bring system back to work\n");
     }
+    return C_DEV_IOCTL;
+}
+
+struct daemon_t
+{
+    const char *fname;
+    const char *initrd;
+    const char *cmdline;
+    const struct flags_t *flags; /* as given on command line; loading image may change them, so a copy is used */
+    struct flags_t loaded;       /* flags the payload was prepared with */
+    dev_t disk;
+    int tty;
+    struct kexec_info_t kexec_info;
+    uint64_t key;                /* identity of image files as of before loading them, 0 if it can't be checked */
+    const char *key_note;        /* what is not covered by key, NULL if nothing */
+    struct timespec prepared;
+    int ready;
+    struct worker_t w;           /* holds failure of the last reload or go */
+};
+
+#define DEVICE_KEY_SIZE 65536 /* start of block device image compared, holding partition table or BCD header and file table */
+
+static uint64_t device_key(int fd, const char *path, const struct stat *st)
+{
+    /* Writes to a disk don't change anything stat() tells, so its size and the start of it are compared instead; 0 if unreadable */
+    char *buf = malloc(DEVICE_KEY_SIZE);
+    if (buf == NULL) return 0;
+    ssize_t r = pread(fd, buf, DEVICE_KEY_SIZE, 0);
+    uint64_t fields[] = { st->st_rdev, lseek(fd, 0, SEEK_END) };
+    uint64_t h = hash64(path, strlen(path), CACHE_VERSION);
+    h = hash64(fields, sizeof(fields), h);
+    if (r > 0) h = hash64(buf, r, h);
+    free(buf);
+    return (r > 0) ? h : 0;
+}
+
+static uint64_t image_key(const char *fname, const char *initrd, const struct flags_t *flags, const char **note)
+{
+    /* Same identity as staging cache uses for files; pattern is expanded again, so a newly installed image is noticed too */
+    glob_t globbuf;
+    uint64_t key = 0;
+    *note = "image files can't be checked for changes";
+    if (glob(fname, GLOB_ERR | GLOB_TILDE, NULL, &globbuf)) return 0;
+    if (globbuf.gl_pathc == 1)
+    {
+        int fd = open(globbuf.gl_pathv[0], O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd != -1 && fstat(fd, &st) == 0 && S_ISBLK(st.st_mode))
+        {
+            uint64_t h = device_key(fd, globbuf.gl_pathv[0], &st);
+            if (h && (key = payload_key(h, initrd, flags))) *note = "only size and first 64 KiB of image disk are checked for changes";
+        }
+        else if (fd != -1 && (key = cache_key(fd, globbuf.gl_pathv[0], initrd, flags)))
+        {
+            *note = NULL;
+        }
+        if (fd != -1) close(fd);
+    }
+    globfree(&globbuf);
+    return key;
+}
+
+static void reset_payload(void)
+{
+    /* Drop everything prepared, so that image can be loaded anew */
+    free_static();
+    lintel.image = NULL;
+    lintel.image_size = 0;
+    kernel.image = NULL;
+    kernel.image_size = 0;
+    kernel.initrd = NULL;
+    kernel.initrd_size = 0;
+    kernel.cmdline_size = 0;
+    memset(kcmdline, 0, COMMAND_LINE_SIZE);
+    jumper_info = NULL;
+    free(current_cmdline);
+    current_cmdline = NULL;
+}
+
+static void *prepare_main(void *arg)
+{
+    /* Everything that can be done ahead of time, up to patched image ready to be passed to kernel */
+    struct daemon_t *d = arg;
+    d->ready = 0;
+    reset_payload();
+    d->loaded = *d->flags;
+    memset(&d->kexec_info, 0xff, sizeof(d->kexec_info));
+    /* Identity is taken before loading and checked again after it, so that files replaced meanwhile are not taken for the loaded ones.
+       Flags as given are used, loading may change them */
+    const char *note;
+    d->key = image_key(d->fname, d->initrd, d->flags, &d->key_note);
+    struct loader_t loader = { d->fname, d->initrd, &d->loaded };
+    loader_main(&loader);
+    if (d->key && image_key(d->fname, d->initrd, d->flags, &note) != d->key) cancel(C_DAEMON_STALE, "Image files have changed while they were loaded, send reload again\n");
+    fill_kexec_info(&d->kexec_info, &d->loaded, d->disk);
+    finish_image(d->cmdline, &d->loaded, &d->kexec_info);
+    if (d->key_note) printf("Note: %s.\n", d->key_note);
+    clock_gettime(CLOCK_MONOTONIC, &d->prepared);
+    d->ready = 1;
+    return NULL;
+}
+
+static void *validate_main(void *arg)
+{
+    /* Cheap checks right before going: image files are the same, and system is still in a state fit for reboot */
+    struct daemon_t *d = arg;
+    int ph = phase_begin("daemon.validate");
+    const char *note;
+    if (d->key && image_key(d->fname, d->initrd, d->flags, &note) != d->key) cancel(C_DAEMON_STALE, "Image files have changed since they were loaded, send reload first\n");
+    if (d->key_note) printf("Note: %s.\n", d->key_note);
+    check_system(&d->loaded);
+    phase_end(ph, 0);
+    return NULL;
+}
+
+static void daemon_reply(int c, const char *fmt, ...)
+{
+    char buf[1024];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (len > (int)sizeof(buf) - 1) len = sizeof(buf) - 1;
+    for (int done = 0; done < len; )
+    {
+        ssize_t w = send(c, buf + done, len - done, MSG_NOSIGNAL);
+        if (w == -1 && errno == EINTR) continue;
+        if (w <= 0) return;
+        done += w;
+    }
+}
+
+static void daemon_status(int c, const struct daemon_t *d)
+{
+    if (!d->ready) { daemon_reply(c, "failed: %s", d->w.msg); return; }
+    const char *sep = d->key_note ? "; " : "", *note = d->key_note ? d->key_note : "";
+    if (d->loaded.iskernel) daemon_reply(c, "ready: kernel of %llu bytes, initrd of %llu bytes, prepared %.1f s ago%s%s\n", (unsigned long long)kernel.image_size, (unsigned long long)kernel.initrd_size, elapsed_since(&d->prepared) / 1e3, sep, note);
+    else daemon_reply(c, "ready: lintel of %llu bytes%s, prepared %.1f s ago%s%s\n", (unsigned long long)lintel.image_size, jumper_info ? " with kexec jumper" : "", elapsed_since(&d->prepared) / 1e3, sep, note);
+}
+
+static int daemon_command(int c, char *cmd, size_t size)
+{
+    /* Reads one line from client, waiting for it a few seconds at most; returns 0 if got it */
+    size_t len = 0;
+    while (len < size - 1)
+    {
+        struct pollfd p = { c, POLLIN, 0 };
+        int r = poll(&p, 1, DAEMON_CLIENT_TIMEOUT);
+        if (r == -1 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        ssize_t n = read(c, cmd + len, size - 1 - len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        len += n;
+        if (memchr(cmd, '\n', len)) break;
+    }
+    cmd[len] = '\0';
+    *strchrnul(cmd, '\n') = '\0';
+    len = strlen(cmd);
+    if (len && cmd[len - 1] == '\r') cmd[len - 1] = '\0';
+    return 0;
+}
+
+static int run_daemon(struct daemon_t *d)
+{
+    /* Payload is prepared once here (failure is fatal), then reloaded or started on request from local socket */
+    const char *path = d->flags->daemon;
+    printf("Preparing payload to wait with...\n");
+    prepare_main(d);
+    if (lock_images && (mlock(&lintel, sizeof(lintel)) || mlock(&kernel, sizeof(kernel)) || mlock(kcmdline, sizeof(kcmdline)))) printf("Can't lock boot parameters in memory: %s\n", strerror(errno));
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) cancel(C_DAEMON_SOCKET, "Path to control socket %s is longer than %d bytes\n", path, (int)sizeof(addr.sun_path) - 1);
+    strcpy(addr.sun_path, path);
+    int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s == -1) cancel(C_DAEMON_SOCKET, "Can't create control socket: %s\n", strerror(errno));
+
+    /* Socket left by previous instance is replaced, but nothing else is */
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+    mode_t mask = umask(0077);
+    int e = bind(s, (struct sockaddr *)&addr, sizeof(addr)) ? errno : 0;
+    umask(mask);
+    if (e || listen(s, 4)) { e = e ? e : errno; close(s); cancel(C_DAEMON_SOCKET, "Can't listen on control socket %s: %s\n", path, strerror(e)); }
+    printf("Payload is ready, waiting for commands on %s.\n", path);
+
+    for (;;)
+    {
+        int c = accept4(s, NULL, NULL, SOCK_CLOEXEC);
+        if (c == -1 && (errno == EINTR || errno == ECONNABORTED)) continue;
+        if (c == -1) { e = errno; close(s); unlink(path); cancel(C_DAEMON_SOCKET, "Can't accept connection on control socket: %s\n", strerror(e)); }
+
+        /* Socket is only accessible by owner, but peer is checked anyway: it may reboot the machine */
+        struct ucred cred;
+        socklen_t credlen = sizeof(cred);
+        char cmd[64];
+        if (getsockopt(c, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) || (cred.uid != 0 && cred.uid != geteuid()))
+        {
+            daemon_reply(c, "denied\n");
+        }
+        else if (daemon_command(c, cmd, sizeof(cmd)) == 0)
+        {
+            printf("Got %s command.\n", cmd);
+            if (!strcmp(cmd, "status"))
+            {
+                daemon_status(c, d);
+            }
+            else if (!strcmp(cmd, "reload"))
+            {
+                phases_num = 0; /* Report covers the last preparation only */
+                int r = start_worker(&d->w, prepare_main, d);
+                if (r) { d->ready = 0; snprintf(d->w.msg, sizeof(d->w.msg), "Can't start loader: %s\n", strerror(r)); }
+                else if (join_worker(&d->w) != C_SUCCESS) { d->ready = 0; printf("%s", d->w.msg); }
+                daemon_status(c, d);
+            }
+            else if (!strcmp(cmd, "go"))
+            {
+                int r = d->ready ? start_worker(&d->w, validate_main, d) : 0;
+                if (!d->ready)
+                {
+                    daemon_reply(c, "failed: no payload is prepared, send reload first\n");
+                }
+                else if (r || join_worker(&d->w) != C_SUCCESS)
+                {
+                    if (r) snprintf(d->w.msg, sizeof(d->w.msg), "Can't start validation: %s\n", strerror(r));
+                    printf("%s", d->w.msg);
+                    daemon_reply(c, "failed: %s", d->w.msg);
+                }
+                else
+                {
+                    daemon_reply(c, "going\n");
+                    close(c);
+                    close(s);
+                    unlink(path);
+                    struct flush_t flush;
+                    if (d->loaded.fsflush) start_flush(&flush);
+                    return reboot_now(d->tty, &d->loaded, &flush);
+                }
+            }
+            else
+            {
+                daemon_reply(c, "unknown command, expected status, reload or go\n");
+            }
+        }
+        close(c);
+    }
+}
+
+struct bench_t
+{
+    const char *name;
+    int mmap;
+    int direct;
+    int depth;   /* io_depth to read with */
+    int stream;  /* image is read as standard input redirected from the file */
+};
+
+static void drop_cache(const char *path)
+{
+    /* Image files are only read, so their pages are clean and simply discarded */
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static void reset_peak_rss(void)
+{
+    /* Needs Linux 4.0 or newer; without it, peak of the whole run is reported. It's about this process, so --proc-root does not apply */
+    int fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+    if (fd == -1) return;
+    if (write(fd, "5", 1) == -1) printf("Can't reset peak memory usage: %s\n", strerror(errno));
+    close(fd);
+}
+
+static long peak_rss(void)
+{
+    /* In KiB */
+    char line[128];
+    long kb = -1;
+    FILE *f = fopen("/proc/self/status", "re");
+    if (f)
+    {
+        while (fgets(line, sizeof(line), f)) if (sscanf(line, "VmHWM: %ld", &kb) == 1) break;
+        fclose(f);
+    }
+    if (kb == -1)
+    {
+        struct rusage ru;
+        if (getrusage(RUSAGE_SELF, &ru) == 0) kb = ru.ru_maxrss;
+    }
+    return kb;
+}
+
+static int compare_ms(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void bench_quiet(int quiet)
+{
+    /* Loading is as verbose as ever, but only the summary is wanted; failures are reported after output is restored */
+    static int saved = -1;
+    fflush(stdout);
+    if (quiet)
+    {
+        int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        if (null == -1) return;
+        saved = dup(STDOUT_FILENO);
+        dup2(null, STDOUT_FILENO);
+        close(null);
+    }
+    else if (saved != -1)
+    {
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+        saved = -1;
+    }
+}
+
+static double bench_once(struct daemon_t *d, const char *path, int cold, u64 *bytes)
+{
+    /* Returns time to prepare the payload in ms; dropping previous one and page cache is not counted */
+    reset_payload();
+    phases_num = 0;
+    if (cold)
+    {
+        drop_cache(path);
+        if (d->flags->initrds_num > 1) for (int i = 0; i < d->flags->initrds_num; ++i) drop_cache(d->flags->initrds[i]);
+        else if (d->initrd[0]) drop_cache(d->initrd);
+    }
+    if (!strcmp(d->fname, "-")) rewind(stdin);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int r = start_worker(&d->w, prepare_main, d);
+    if (r) { bench_quiet(0); cancel(C_BENCH_THREAD, "Can't start loader: %s\n", strerror(r)); }
+    if (join_worker(&d->w) != C_SUCCESS) { bench_quiet(0); cancel(d->w.code, "%s", d->w.msg); }
+    double ms = elapsed_since(&start);
+    *bytes = d->loaded.iskernel ? kernel.image_size + kernel.initrd_size : lintel.image_size;
+    return ms;
 }
+
+static int run_bench(struct daemon_t *d, int runs)
+{
+    /* Payload is prepared over and over with each way of reading files; nothing is done to the system */
+    printf("Preparing payload to benchmark with...\n");
+    prepare_main(d);
+
+    glob_t globbuf;
+    char path[PATH_MAX];
+    struct stat st;
+    if (glob(d->fname, GLOB_ERR | GLOB_TILDE, NULL, &globbuf) || globbuf.gl_pathc != 1) cancel(C_BENCH_FILE, "Image %s can't be found again\n", d->fname);
+    int toolong = path_snprintf_nc(path, "%s", globbuf.gl_pathv[0]);
+    globfree(&globbuf);
+    if (toolong) cancel(C_PATH_LONG, "Path to image file is greater than %d bytes", PATH_MAX - 1);
+    if (stat(path, &st) || (!S_ISREG(st.st_mode) && !S_ISBLK(st.st_mode))) cancel(C_BENCH_FILE, "Image %s should be a regular file or a block device to be read repeatedly\n", path);
+
+    struct bench_t backends[] =
+    {
+        { "stdin",    0, 0, 0,        1 },
+        { "pread",    0, 0, 0,        0 },
+#ifdef USE_IO_URING
+        { "io_uring", 0, 0, io_depth, 0 },
 #endif
+        { "mmap",     1, 0, io_depth, 0 },
+        { "direct",   0, 1, io_depth, 0 },
+    };
+    const int backends_num = sizeof(backends) / sizeof(backends[0]);
+    double *ms = malloc(runs * sizeof(double));
+    if (ms == NULL) cancel(C_BENCH_ALLOC, "Can't allocate memory for %d benchmark results\n", runs);
+    const char *fname = d->fname;
+    const struct flags_t *flags = d->flags;
+    int depth = io_depth;
+
+    printf("Benchmarking %d cold and %d warm runs of loading %s:\n", runs, runs, path);
+    printf("%-9s %-5s %10s %10s %10s %10s %14s\n", "Backend", "Cache", "min, ms", "median, ms", "p99, ms", "MB/s", "peak RSS, KiB");
+    for (int b = 0; b < backends_num; ++b)
+    {
+        if (!strcmp(backends[b].name, "io_uring") && backends[b].depth < 2) continue;
+        struct flags_t f = *flags;
+        f.mmap = backends[b].mmap;
+        f.direct = backends[b].direct;
+        f.cache = NULL; /* Staging cache would measure itself rather than reading files */
+        io_depth = backends[b].depth;
+        d->flags = &f;
+        d->fname = fname;
+        if (backends[b].stream)
+        {
+            int fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (fd == -1 || dup2(fd, STDIN_FILENO) == -1) cancel(C_BENCH_FILE, "Can't redirect standard input from %s: %s\n", path, strerror(errno));
+            close(fd);
+            d->fname = "-";
+        }
+
+        for (int cold = 1; cold >= 0; --cold)
+        {
+            u64 bytes = 0;
+            reset_payload();
+            reset_peak_rss();
+            bench_quiet(1);
+            for (int i = 0; i < runs; ++i) ms[i] = bench_once(d, path, cold, &bytes);
+            bench_quiet(0);
+            long rss = peak_rss();
+
+            qsort(ms, runs, sizeof(double), compare_ms);
+            double median = (runs % 2) ? ms[runs / 2] : (ms[runs / 2 - 1] + ms[runs / 2]) / 2;
+            double p99 = ms[(runs * 99 + 99) / 100 - 1];
+            printf("%-9s %-5s %10.3f %10.3f %10.3f %10.1f %14ld\n", backends[b].name, cold ? "cold" : "warm", ms[0], median, p99, median > 0 ? bytes / median / 1e3 : 0.0, rss);
+        }
+    }
+    free(ms);
+    io_depth = depth;
+    d->flags = flags;
+    d->fname = fname;
+    reset_payload();
+    return C_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+    clock_gettime(CLOCK_MONOTONIC, &run_start);
+    int tty = -1;
+    struct flags_t flags = DEFAULT_FLAGS;
+    struct kexec_info_t kexec_info;
+    dev_t disk;
+    memset(&kexec_info, 0xff, sizeof(kexec_info));
+    char cmdline[COMMAND_LINE_SIZE];
+    char initrd[PATH_MAX];
+    memset(cmdline, 0, COMMAND_LINE_SIZE);
+    memset(initrd, 0, PATH_MAX);
+    const char *fname = check_args(argc, argv, "/opt/mcst/lintel/bin/lintel_*.disk", &tty, &flags, &disk, cmdline, initrd);
+    if (flags.list || flags.extract_num) inspect(argc, argv, fname, &flags);
+    if (flags.daemon && !strcmp(fname, "-")) cancel(C_DAEMON_STDIN, "Image from standard input can't be reloaded, so it can't be used with --daemon\n");
+    if (flags.bench && !strcmp(fname, "-")) cancel(C_BENCH_FILE, "Image from standard input can't be read repeatedly, so it can't be used with --bench-load\n");
+    char autodisk[PATH_MAX];
+    if (!strcmp(fname, "auto"))
+    {
+        int ph = phase_begin("find_bcd_disk");
+        find_bcd_disk(autodisk, flags.askfordisk ? NULL : &disk);
+        phase_end(ph, 0);
+        fname = autodisk;
+    }
+    lintel.image = NULL;
+    kernel.cmdline = kcmdline;
+    kernel.cmdline_size = 0;
+    kernel.image = NULL;
+    kernel.initrd = NULL;
+    memset(kcmdline, 0, COMMAND_LINE_SIZE);
+    atexit(free_static);
+    int ph;
+
+    if (flags.bench)
+    {
+        struct daemon_t d = { fname, initrd, cmdline, &flags };
+        d.disk = disk;
+        return run_bench(&d, flags.bench);
+    }
+
+    if (flags.daemon)
+    {
+        struct daemon_t d = { fname, initrd, cmdline, &flags };
+        d.disk = disk;
+        d.tty = tty;
+        return run_daemon(&d);
+    }
+
+    /* Image is read in background while the system is being checked */
+    struct worker_t loader_worker;
+    struct loader_t loader = { fname, initrd, &flags };
+    int bgload = flags.bgload;
+    if (bgload)
+    {
+        int e = start_worker(&loader_worker, loader_main, &loader);
+        if (e)
+        {
+            printf("Can't start background image loader (%s), will load image afterwards.\n", strerror(e));
+            bgload = 0;
+        }
+    }
+
+    check_system(&flags);
+    fill_kexec_info(&kexec_info, &flags, disk);
+
+    struct flush_t flush;
+    if (flags.fsflush)
+    {
+        start_flush(&flush);
+    }
+
+    if (bgload)
+    {
+        ph = phase_begin("load_image.wait");
+        if (join_worker(&loader_worker) != C_SUCCESS) cancel(loader_worker.code, "%s", loader_worker.msg);
+        phase_end(ph, 0);
+    }
+    else
+    {
+        loader_main(&loader);
+    }
+    finish_image(cmdline, &flags, &kexec_info);
+
+    return reboot_now(tty, &flags, &flush);
+}
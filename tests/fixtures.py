@@ -0,0 +1,232 @@
+#!/usr/bin/env python3
+# Generators of sysfs, procfs and devices trees, and of image files, that kexec-e2k is pointed at
+# with --sys-root, --proc-root and --dev-root in tests and benchmarks.
+#
+# Every tree is made of plain files, directories and symlinks laid out the way kernel lays them out,
+# so nothing here needs root privileges. Kexec and framebuffer devices are regular files, which
+# kexec-e2k treats as fake devices: parameters are written to the former instead of rebooting, and
+# the latter holds the number of the framebuffer the consoles are mapped to.
+#
+# Run as a script to generate a tree for manual runs, e.g.
+#     fixtures.py sys /tmp/fx/sys --vtcons=1000 --depth=8 --fanout=2
+#     fixtures.py proc /tmp/fx/proc --pids=50000
+#     fixtures.py dev /tmp/fx/dev --fbs=100
+
+import argparse
+import os
+import random
+import struct
+import sys
+
+BRIDGE = '0000:00:01.0'
+VIDEO = '0000:01:00.0'
+VIDEO_AUDIO = '0000:01:00.1'
+DRIVER = 'radeon'
+
+
+def write(path, data=''):
+    os.makedirs(os.path.dirname(path), exist_ok=True)
+    with open(path, 'wb' if isinstance(data, bytes) else 'w') as f:
+        f.write(data)
+
+
+def link(target, path):
+    os.makedirs(os.path.dirname(path), exist_ok=True)
+    os.symlink(target, path)
+
+
+def pci_id(bus, slot, func=0):
+    return '0000:%02x:%02x.%x' % (bus, slot, func)
+
+
+def make_sys(root, vtcons=2, depth=1, fanout=1, fbs=1, tty=1):
+    '''
+    Sysfs with a video adapter behind PCI bridge BRIDGE: its display function VIDEO drives framebuffer 0,
+    audio function VIDEO_AUDIO sits next to it, and a chain of bridges `depth' levels deep, each with
+    `fanout' devices, hangs off VIDEO to stress PCI removal. Of `vtcons' virtual consoles the last one
+    is the bound framebuffer console. Returns list of remove files of devices behind BRIDGE.
+    '''
+    write(os.path.join(root, 'class/tty/tty0/active'), 'tty%d\n' % tty)
+    pcidevices = os.path.join(root, 'bus/pci/devices')
+    top = os.path.join(root, 'devices/pci0000:00')
+    os.makedirs(os.path.join(top, BRIDGE, 'power'))
+    link('../../../devices/pci0000:00/' + BRIDGE, os.path.join(pcidevices, BRIDGE))
+    os.makedirs(os.path.join(root, 'bus/pci/drivers', DRIVER))
+
+    removes = []
+    ids = [0]
+
+    def device(parent, rel, name, level):
+        path = os.path.join(parent, name)
+        write(os.path.join(path, 'remove'))
+        write(os.path.join(path, 'vendor'), '0x1002\n')
+        removes.append(os.path.join(path, 'remove'))
+        link('../../../devices/pci0000:00/' + rel + '/' + name, os.path.join(pcidevices, name))
+        if level < depth:
+            for _ in range(fanout):
+                ids[0] += 1
+                n = ids[0]
+                device(path, rel + '/' + name, pci_id(2 + n // 256, n // 8 % 32, n % 8), level + 1)
+        return path
+
+    video = device(os.path.join(top, BRIDGE), BRIDGE, VIDEO, 1)
+    device(os.path.join(top, BRIDGE), BRIDGE, VIDEO_AUDIO, depth)
+    link('../../../../bus/pci/drivers/' + DRIVER, os.path.join(video, 'driver'))
+
+    for fb in range(fbs):
+        target = '../../../devices/pci0000:00/%s/%s' % (BRIDGE, VIDEO) if fb == 0 else '../../../devices/platform/vga16fb.%d' % fb
+        link(target, os.path.join(root, 'class/graphics/fb%d/device' % fb))
+
+    vtconsole = os.path.join(root, 'devices/virtual/vtconsole')
+    for i in range(vtcons):
+        last = (i == vtcons - 1)
+        write(os.path.join(vtconsole, 'vtcon%d' % i, 'name'), '(M) frame buffer device\n' if last else '(S) dummy device\n')
+        write(os.path.join(vtconsole, 'vtcon%d' % i, 'bind'), '1\n' if last else '0\n')
+        link('../../devices/virtual/vtconsole/vtcon%d' % i, os.path.join(root, 'class/vtconsole/vtcon%d' % i))
+    return removes
+
+
+def make_proc(root, pids=100, xserver=None, cmdline='root=/dev/sda1 console=ttyS0,115200 quiet'):
+    '''
+    Procfs with `pids' processes running shells, and one more running `xserver' if it is given.
+    '''
+    write(os.path.join(root, 'cmdline'), cmdline + '\n')
+    link('1', os.path.join(root, 'self'))
+    os.makedirs(os.path.join(root, 'sys/kernel'))
+    write(os.path.join(root, 'uptime'), '1.00 1.00\n')
+    for pid in range(1, pids + 1):
+        link('/usr/bin/bash' if pid % 2 else '/usr/sbin/sshd', os.path.join(root, str(pid), 'exe'))
+    if xserver:
+        link('/usr/bin/' + xserver, os.path.join(root, str(pids + 1), 'exe'))
+
+
+def make_dev(root, fbs=1, console_fb=0):
+    '''
+    Devices with an empty fake kexec device, VGA arbiter pointing at VIDEO, and `fbs' fake framebuffer
+    devices mapping consoles to framebuffer `console_fb'. Returns path of the fake kexec device.
+    '''
+    os.makedirs(root, exist_ok=True)
+    write(os.path.join(root, 'kexec'))
+    write(os.path.join(root, 'vga_arbiter'), 'count:1,PCI:%s,decodes=io+mem,owns=io+mem,locks=none(0:0)\n' % VIDEO)
+    for fb in range(fbs):
+        write(os.path.join(root, 'fb%d' % fb), '%d\n' % console_fb)
+    return os.path.join(root, 'kexec')
+
+
+def make_tree(root, vtcons=2, depth=1, fanout=1, fbs=1, pids=100, xserver=None):
+    '''
+    All three trees under root; returns (kexec-e2k arguments pointing at them, fake kexec device, remove files).
+    '''
+    removes = make_sys(os.path.join(root, 'sys'), vtcons, depth, fanout, fbs)
+    make_proc(os.path.join(root, 'proc'), pids, xserver)
+    kexec = make_dev(os.path.join(root, 'dev'), fbs)
+    args = ['--sys-root=' + os.path.join(root, 'sys'), '--proc-root=' + os.path.join(root, 'proc'), '--dev-root=' + os.path.join(root, 'dev')]
+    return args, kexec, removes
+
+
+def make_blob(path, size, seed):
+    data = random.Random(seed).randbytes(size)
+    write(path, data)
+    return data
+
+
+def elf_image(segments, size, seed, phoff=64, ident=b'\x7fELF\x02\x01\x01'):
+    '''
+    64-bit little-endian ELF kernel of `size' bytes of random data, with program headers at `phoff' and
+    section headers at the end (as much of program headers as fits is written); `segments' is a list of (type, offset, filesz, memsz, vaddr).
+    '''
+    data = bytearray(random.Random(seed).randbytes(size))
+    shoff = size - 64 * 4
+    data[0:64] = ident.ljust(16, b'\0') + struct.pack('<HHIQQQIHHHHHH', 2, 0xaf, 1, 0x10000, phoff, shoff, 0, 64, 56, len(segments), 64, 4, 3)
+    for n, (ptype, offset, filesz, memsz, vaddr) in enumerate(segments):
+        if phoff + 56 * (n + 1) > size: break  # table sticking out of file is cut
+        struct.pack_into('<IIQQQQQQ', data, phoff + 56 * n, ptype, 5, offset, vaddr, vaddr, filesz, memsz, 0x1000)
+    return data
+
+
+BCD_SIGNATURE = 0x012345678ABCDEF0
+BLOCK = 512
+
+
+def bcd_image(files, blocks, free_lba, extra=None):
+    '''
+    BCD container of `blocks' blocks: header at block 1, file table after it; `files' is a list of (lba, size, tag, data),
+    `extra' is a list of (offset, data) written over the rest.
+    '''
+    img = bytearray(blocks * BLOCK)
+    hdr = struct.pack('<QIQ', BCD_SIGNATURE, len(files), free_lba)
+    tbl = b''.join(struct.pack('<QQQII', lba, size, size, tag, 0) for lba, size, tag, data in files)
+    img[BLOCK:BLOCK + len(hdr) + len(tbl)] = hdr + tbl
+    for lba, size, tag, data in files:
+        img[lba * BLOCK:lba * BLOCK + len(data)] = data
+    for off, data in (extra or []):
+        img[off:off + len(data)] = data
+    return img
+
+
+def make_bcd(path):
+    '''
+    BCD image with lintel (tag 0) at block 8, kexec jumper (tag 9) at block 12 and log (tag 7) at block 20.
+    Lintel ends with a sub-header listing itself and kexec jumper, and kexec jumper ends with kexec_info
+    header, so that kexec-e2k loads blocks 8 to 19 as one lintel image. Returns lintel data.
+    '''
+    lintel = bytes((i * 7) & 0xff for i in range(8 * BLOCK, 11 * BLOCK))
+    sub = struct.pack('<QIQ', BCD_SIGNATURE, 2, 0) + struct.pack('<QQQII', 8, 4, 4, 0, 0) + struct.pack('<QQQII', 0, 0, 0, 9, 0)
+    info = struct.pack('<4I', 0x61746164, 0x01000000, 512, 1)
+    img = bcd_image([(8, 4, 0, lintel), (12, 8, 9, b''), (20, 4, 7, b'\x5a' * 4 * BLOCK)], 24, 20,
+                    [(11 * BLOCK, sub), (19 * BLOCK, info)])
+    write(path, bytes(img))
+    return lintel
+
+
+def disk_image(bcd, layout, start, size, part=1, sector=512):
+    '''
+    Disk of `size' bytes with `bcd' image at byte `start', which is in partition number `part' of
+    `layout': 'mbr', 'gpt' (with protective MBR and `sector' bytes long sectors), or 'none'.
+    '''
+    disk = bytearray(size)
+    disk[start:start + len(bcd)] = bcd
+    if layout == 'none':
+        return disk
+    disk[510:512] = b'\x55\xaa'
+    if layout == 'mbr':
+        # Other partitions hold no BCD container
+        for n in range(1, 5):
+            first = start // 512 if n == part else 1 + n
+            disk[446 + 16 * (n - 1):446 + 16 * n] = struct.pack('<B3xB3xII', 0, 0x83, first, 16)
+        return disk
+    disk[446:462] = struct.pack('<B3xB3xII', 0, 0xee, 1, size // 512 - 1)
+    entries = 128
+    header = b'EFI PART' + struct.pack('<IIII', 0x10000, 92, 0, 0) + struct.pack('<QQQQ', 1, size // sector - 1, 34, size // sector - 34)
+    header += bytes(16) + struct.pack('<QII', 2, entries, 128)
+    disk[sector:sector + len(header)] = header
+    for n in range(1, part + 1):
+        first = start // sector if n == part else 34 + n
+        entry = bytes(range(1, 17)) + bytes(16) + struct.pack('<QQ', first, first + 15)
+        disk[2 * sector + (n - 1) * 128:2 * sector + (n - 1) * 128 + len(entry)] = entry
+    return disk
+
+
+def main():
+    p = argparse.ArgumentParser(description='Generate fixture trees for kexec-e2k --sys-root, --proc-root and --dev-root')
+    p.add_argument('kind', choices=['sys', 'proc', 'dev', 'bcd'])
+    p.add_argument('path')
+    p.add_argument('--vtcons', type=int, default=2)
+    p.add_argument('--depth', type=int, default=1)
+    p.add_argument('--fanout', type=int, default=1)
+    p.add_argument('--fbs', type=int, default=1)
+    p.add_argument('--pids', type=int, default=100)
+    p.add_argument('--xserver')
+    a = p.parse_args()
+    if a.kind == 'sys':
+        make_sys(a.path, a.vtcons, a.depth, a.fanout, a.fbs)
+    elif a.kind == 'proc':
+        make_proc(a.path, a.pids, a.xserver)
+    elif a.kind == 'dev':
+        make_dev(a.path, a.fbs)
+    else:
+        make_bcd(a.path)
+
+
+if __name__ == '__main__':
+    sys.exit(main())
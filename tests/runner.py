@@ -0,0 +1,511 @@
+#!/usr/bin/env python3
+# Runs kexec-e2k against fixture trees made by fixtures.py and checks what it did to them.
+#
+#     runner.py KEXEC_E2K CASE          run test CASE, exit with non-zero status if it fails
+#     runner.py --bench KEXEC_E2K CASE  run benchmark CASE and print timings of its phases
+#     runner.py --list                  list tests and benchmarks
+#
+# Every run passes -f (no sync, flush and remount of host filesystems) and -M (no module unloading),
+# so nothing outside of fixture trees is touched. Runs without -x record payload in fake kexec device.
+# The only runs without -f are those of mountinfo case: with --proc-root given, filesystems from fixture
+# mount table are not actually remounted, and flushing them just syncs fixture directories.
+
+import gzip
+import json
+import os
+import re
+import shutil
+import statistics
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+sys.dont_write_bytecode = True  # source tree is left as is
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import fixtures
+
+SAFE = ['-f', '-M', '-r']
+TIMEOUT = 300
+# Compression formats built in, and compressors of them
+FORMATS = [f for f in os.environ.get('KEXEC_E2K_FORMATS', '').split(',') if f]
+COMPRESSORS = {'gzip': (['gzip', '-f'], '.gz'), 'xz': (['xz', '-f'], '.xz'), 'zstd': (['zstd', '-q', '-f', '--rm'], '.zst')}
+
+
+class Failure(Exception):
+    pass
+
+
+def check(cond, fmt, *args):
+    if not cond:
+        raise Failure(fmt % args)
+
+
+def run(binary, args, code=0, stdin=None, safe=SAFE):
+    '''
+    Runs binary with SAFE options added, checks its exit status and returns its output.
+    '''
+    cmd = [binary] + safe + args
+    p = subprocess.run(cmd, stdin=stdin if stdin is not None else subprocess.DEVNULL, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, timeout=TIMEOUT)
+    out = p.stdout.decode(errors='replace')
+    if p.returncode != code:
+        raise Failure('%s exited with %d instead of %d, output:\n%s' % (' '.join(cmd), p.returncode, code, out))
+    return out
+
+
+def payload(kexec):
+    '''
+    Splits contents of fake kexec device into ioctl name, its header fields and the rest of data.
+    '''
+    with open(kexec, 'rb') as f:
+        data = f.read()
+    check(b'\n' in data, 'Fake kexec device holds no header: %r', data[:64])
+    header, rest = data.split(b'\n', 1)
+    name, *fields = header.decode().split(' ')
+    return name, {k: int(v) for k, v in (f.split('=') for f in fields)}, rest
+
+
+def compress_file(path, fmt):
+    '''
+    Compresses file in place, returns name of compressed file.
+    '''
+    cmd, suffix = COMPRESSORS[fmt]
+    if shutil.which(cmd[0]) is None: raise Failure('%s is needed to test %s compressed images' % (cmd[0], fmt))
+    subprocess.run(cmd + [path], check=True)
+    return path + suffix
+
+
+def read(path):
+    with open(path) as f:
+        return f.read()
+
+
+def read_bytes(path):
+    with open(path, 'rb') as f:
+        return f.read()
+
+
+def case_kernel_payload(binary, tmp):
+    args, kexec, removes = fixtures.make_tree(tmp)
+    kernel = fixtures.make_blob(os.path.join(tmp, 'vmlinux'), 1 << 20, 1)
+    initrd = fixtures.make_blob(os.path.join(tmp, 'initrd'), 300000, 2)
+    cmdline = 'root=/dev/sda2 quiet'
+    run(binary, args + ['-X', '-b', '-c', cmdline, '-I', os.path.join(tmp, 'initrd'), os.path.join(tmp, 'vmlinux')])
+    name, h, rest = payload(kexec)
+    check(name == 'KEXEC_REBOOT', 'Kernel is started with %s', name)
+    check(h == {'image_size': len(kernel), 'initrd_size': len(initrd), 'cmdline_size': len(cmdline)}, 'Wrong kexec parameters: %s', h)
+    check(rest == cmdline.encode() + kernel + initrd, 'Command line, kernel and initrd passed to kexec differ from given ones')
+
+    # Initrds are passed as they are, compressed or not, whether one or several are given; several are padded to 4 bytes each
+    packed = gzip.compress(initrd)
+    fixtures.write(os.path.join(tmp, 'initrd.gz'), packed)
+    for initrds, expected in [(['initrd.gz'], packed), (['initrd.gz', 'initrd'], packed + bytes(-len(packed) % 4) + initrd)]:
+        run(binary, args + ['-X', '-b', '-c', cmdline] + sum((['-I', os.path.join(tmp, i)] for i in initrds), []) + [os.path.join(tmp, 'vmlinux')])
+        name, h, rest = payload(kexec)
+        check(rest[h['cmdline_size'] + h['image_size']:] == expected, 'Initrds %s are not passed as they are', initrds)
+
+
+def case_kernel_cmdline(binary, tmp):
+    args, kexec, removes = fixtures.make_tree(tmp)
+    fixtures.make_blob(os.path.join(tmp, 'vmlinux'), 4096, 1)
+    run(binary, args + ['-X', '-b', '-a', 'single', os.path.join(tmp, 'vmlinux')])
+    name, h, rest = payload(kexec)
+    cmdline = rest[:h['cmdline_size']].decode()
+    check(h['initrd_size'] == 0, 'Initrd is passed while not given')
+    check(cmdline == read(os.path.join(tmp, 'proc/cmdline')).strip() + ' single', 'Command line %r is not the one of running kernel with addition', cmdline)
+
+
+def case_lintel_payload(binary, tmp):
+    args, kexec, removes = fixtures.make_tree(tmp)
+    lintel = fixtures.make_bcd(os.path.join(tmp, 'lintel.disk'))
+    out = run(binary, args + ['-X', '-b', os.path.join(tmp, 'lintel.disk')])
+    name, h, rest = payload(kexec)
+    check(name == 'LINTEL_REBOOT', 'Lintel is started with %s', name)
+    check(h['image_size'] == 12 * fixtures.BLOCK and len(rest) == h['image_size'], 'Lintel and kexec jumper are not passed as one image: %s, %d bytes', h, len(rest))
+    check(rest.startswith(lintel), 'Lintel passed to kexec differs from one in BCD file')
+    check('Active VGA card to boot lintel on is %s.' % fixtures.VIDEO in out, 'VGA card is not taken from VGA arbiter:\n%s', out)
+
+    # Lintel or kexec jumper sticking out of the area loaded for them is refused before anything is done
+    image = read_bytes(os.path.join(tmp, 'lintel.disk'))
+    for lintel_lba, lintel_size, jumper_lba, jumper_size, free_lba in [(8, 16, 12, 8, 20), (8, 4, 12, 12, 20), (8, 4, 4, 8, 20), (30, 4, 12, 8, 20), (8, 0, 12, 8, 20),
+                                                                       (8, (1 << 64) - 4, 12, 8, 20), (8, 4, 12, (1 << 64) - 8, 20)]:
+        bad = bytearray(image)
+        struct.pack_into('<QQQ', bad, fixtures.BLOCK + 20, lintel_lba, lintel_size, lintel_size)
+        struct.pack_into('<QQQ', bad, fixtures.BLOCK + 20 + 32, jumper_lba, jumper_size, jumper_size)
+        fixtures.write(os.path.join(tmp, 'bad.disk'), bytes(bad))
+        fixtures.write(kexec)
+        out = run(binary, args + ['-X', '-b', os.path.join(tmp, 'bad.disk')], code=145)
+        check('don\'t lie below first free block' in out and os.path.getsize(kexec) == 0, 'Lintel at %d of %d blocks and kexec jumper at %d of %d blocks are loaded:\n%s',
+              lintel_lba, lintel_size, jumper_lba, jumper_size, out)
+
+
+def case_fb_reset(binary, tmp):
+    args, kexec, removes = fixtures.make_tree(tmp, vtcons=4, depth=3, fanout=2)
+    fixtures.make_blob(os.path.join(tmp, 'vmlinux'), 4096, 1)
+    out = run(binary, args + ['-X', '-x', '-c', 'quiet', os.path.join(tmp, 'vmlinux')])
+    vtconsole = os.path.join(tmp, 'sys/devices/virtual/vtconsole')
+    binds = {c: read(os.path.join(vtconsole, c, 'bind')) for c in os.listdir(vtconsole)}
+    check(binds == {'vtcon0': '0\n', 'vtcon1': '0\n', 'vtcon2': '0\n', 'vtcon3': '0\n'}, 'Framebuffer console is not unbound: %s', binds)
+    check(all(read(r) == '1\n' for r in removes), 'Not every device behind bridge %s is removed', fixtures.BRIDGE)
+    check(not os.path.exists(os.path.join(tmp, 'sys/devices/pci0000:00', fixtures.BRIDGE, 'remove')), 'Bridge itself is removed')
+    check(os.path.getsize(kexec) == 0, 'Kexec device is written to with -x')
+
+    # Devices must be removed after everything behind them
+    order = re.findall(r'^Removing PCI device \S+/bus/pci/devices/(\S+)\.$', out, re.M)
+    check(len(order) == len(removes), 'Removal of %d devices is reported instead of %d:\n%s', len(order), len(removes), out)
+    for i, path in enumerate(order):
+        check(not any(p.startswith(path + '/') for p in order[i + 1:]), 'Device %s is removed before devices behind it', path)
+
+
+def case_display_server(binary, tmp):
+    args, kexec, removes = fixtures.make_tree(tmp, xserver='Xorg')
+    fixtures.make_blob(os.path.join(tmp, 'vmlinux'), 4096, 1)
+    out = run(binary, args + ['-b', '-c', 'quiet', os.path.join(tmp, 'vmlinux')], code=28)
+    check('Display server process is detected' in out, 'Display server is not reported:\n%s', out)
+    check(os.path.getsize(kexec) == 0, 'Kexec device is written to while display server runs')
+    out = run(binary, args + ['-b', '--display-servers=Xwayland', '-c', 'quiet', os.path.join(tmp, 'vmlinux')])
+    check(os.path.getsize(kexec) > 0, 'Kernel is not started when display server is not in the list')
+
+
+def case_no_processes(binary, tmp):
+    args, kexec, removes = fixtures.make_tree(tmp, pids=0)
+    fixtures.make_blob(os.path.join(tmp, 'vmlinux'), 4096, 1)
+    run(binary, args + ['-b', '-c', 'quiet', os.path.join(tmp, 'vmlinux')], code=125)
+
+
+def case_relocated_roots(binary, tmp):
+    args, kexec, removes = fixtures.make_tree(tmp)
+    fixtures.make_blob(os.path.join(tmp, 'vmlinux'), 4096, 1)
+    out = run(binary, args + ['-X', '-b', '-c', 'quiet', os.path.join(tmp, 'vmlinux')])
+    check('Filesystem roots are relocated, not checking whether they are mounted.' in out, 'Mountpoints of relocated roots are checked:\n%s', out)
+    check('trying to fix it' not in out, 'Mounting over relocated root is attempted:\n%s', out)
+
+
+def case_cache_header(binary, tmp):
+    args, kexec, removes = fixtures.make_tree(tmp)
+    kernel = fixtures.make_blob(os.path.join(tmp, 'vmlinux'), 100000, 1)
+    initrd = fixtures.make_blob(os.path.join(tmp, 'initrd'), 30000, 2)
+    cache = os.path.join(tmp, 'cache')
+    cmd = args + ['-X', '-b', '-c', 'quiet', '--cache=' + cache, '-I', os.path.join(tmp, 'initrd'), os.path.join(tmp, 'vmlinux')]
+    expected = b'quiet' + kernel + initrd
+    run(binary, cmd)
+    entries = os.listdir(cache)
+    check(len(entries) == 1 and entries[0].endswith('.payload'), 'Payload is not stored in cache: %s', entries)
+    entry = os.path.join(cache, entries[0])
+    with open(entry, 'rb') as f:
+        good = f.read()
+    out = run(binary, cmd)
+    check('Loaded prepared payload from cache' in out, 'Payload is not loaded from cache:\n%s', out)
+    check(payload(kexec)[2] == expected, 'Payload loaded from cache differs from given files')
+
+    # Header is magic, version, iskernel, key, content hash, image size, initrd size, jumper offset, noinitrd
+    fields = {'magic': (0, '<Q'), 'version': (8, '<I'), 'key': (16, '<Q'), 'content_hash': (24, '<Q'), 'image_size': (32, '<Q'),
+              'initrd_size': (40, '<Q'), 'jumper_offset': (48, '<q')}
+    damages = [('magic', 0), ('version', 1), ('key', 0), ('content_hash', 0), ('image_size', 0), ('image_size', len(kernel) + 1),
+               ('image_size', 2 ** 64 - 1), ('image_size', 2 ** 64 - 4096), ('initrd_size', len(initrd) + 4096), ('initrd_size', 2 ** 64 - 4096),
+               ('jumper_offset', len(kernel)), ('jumper_offset', 2 ** 63 - 1)]
+    for field, value in damages:
+        off, fmt = fields[field]
+        bad = bytearray(good)
+        struct.pack_into(fmt, bad, off, value)
+        if field == 'jumper_offset': struct.pack_into('<I', bad, 12, 0)  # lintel payload, so that jumper offset is used
+        with open(entry, 'wb') as f:
+            f.write(bad)
+        out = run(binary, cmd)
+        check('is stale or damaged, ignoring it' in out, 'Cache entry with %s = %d is not rejected:\n%s', field, value, out)
+        check(payload(kexec)[2] == expected, 'Payload differs from given files after cache entry with %s = %d is rejected', field, value)
+
+    # Damaged contents, truncated entry, and entry others could have written are not used either
+    for name, data, mode in [('contents', good[:-1] + bytes([good[-1] ^ 1]), 0o600), ('truncation', good[:100], 0o600), ('mode', good, 0o620)]:
+        with open(entry, 'wb') as f:
+            f.write(data)
+        os.chmod(entry, mode)
+        out = run(binary, cmd)
+        check('Loaded prepared payload from cache' not in out, 'Cache entry with damaged %s is used:\n%s', name, out)
+        check(payload(kexec)[2] == expected, 'Payload differs from given files after cache entry with damaged %s is rejected', name)
+
+
+def case_bcd_inspect(binary, tmp):
+    disk = os.path.join(tmp, 'lintel "1".disk')
+    lintel = fixtures.make_bcd(disk)
+    with open(disk, 'rb') as f:
+        image = f.read()
+    blocks = lambda lba, size: image[lba * fixtures.BLOCK:(lba + size) * fixtures.BLOCK]
+
+    out = run(binary, ['--list', disk])
+    check(re.search(r'^\s+0\s+lintel\s+8\s+4\s+4\s+0x00000000$', out, re.M) and re.search(r'^\s+2\s+log\s+20\s+4\s+4\s', out, re.M), 'Wrong BCD file table:\n%s', out)
+    listed = json.loads(run(binary, ['--list=json', disk]))
+    check(listed[0]['path'] == disk and [(f['name'], f['lba'], f['size']) for f in listed[0]['files']] == [('lintel', 8, 4), ('kexec_jumper', 12, 8), ('log', 20, 4)],
+          'Wrong BCD file table in JSON: %s', listed)
+    with open(disk, 'rb') as f:
+        check(json.loads(run(binary, ['--list=json', '-'], stdin=f)) == [dict(listed[0], path='-')], 'BCD file redirected to standard input is listed differently')
+
+    # Damaged tables: every file is listed or has its error reported, as valid JSON
+    damaged = {
+        'short': image[:fixtures.BLOCK + 8],
+        'signature': image[:fixtures.BLOCK] + b'\0' + image[fixtures.BLOCK + 1:],
+        'too_large': fixtures.bcd_image([], 2, 0)[:fixtures.BLOCK + 8] + struct.pack('<I', 1 << 20) + bytes(fixtures.BLOCK),
+        'truncated': fixtures.bcd_image([], 2, 0)[:fixtures.BLOCK + 8] + struct.pack('<I', 60000) + bytes(fixtures.BLOCK),
+    }
+    for name, data in damaged.items():
+        fixtures.write(os.path.join(tmp, name + '.disk'), bytes(data))
+    paths = [disk] + [os.path.join(tmp, name + '.disk') for name in damaged] + [os.path.join(tmp, 'missing.disk')]
+    listed = json.loads(run(binary, ['--list=json'] + paths, code=146))
+    errors = [f.get('error') for f in listed]
+    check([f['path'] for f in listed] == paths, 'Not every file is listed: %s', listed)
+    check(errors == [None, 'file is too short', 'not a BCD file', 'file table is too large', 'file table is truncated', os.strerror(2)], 'Wrong errors: %s', errors)
+    with open(disk, 'rb') as f:
+        p = subprocess.Popen([binary, '--list', '-'], stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+        out = p.communicate(f.read())[0].decode()
+    check(p.returncode == 146 and 'pipe' in out, 'BCD file is listed from a pipe:\n%s', out)
+
+    # Files are extracted by tag name or number, to files or standard output
+    out = run(binary, ['--extract=lintel=' + os.path.join(tmp, 'lintel'), '--extract=9=' + os.path.join(tmp, 'jumper'), disk])
+    check(read_bytes(os.path.join(tmp, 'lintel')) == blocks(8, 4) and blocks(8, 4).startswith(lintel), 'Extracted lintel differs from the one in BCD file')
+    check(read_bytes(os.path.join(tmp, 'jumper')) == blocks(12, 8), 'Extracted kexec jumper differs from the one in BCD file')
+    p = subprocess.run([binary, '--extract=log=-', disk], stdout=subprocess.PIPE)
+    check(p.returncode == 0 and p.stdout == blocks(20, 4), 'Log extracted to standard output differs from the one in BCD file')
+    for spec in ['lintel_obj=' + os.path.join(tmp, 'x'), 'nosuchtag=' + os.path.join(tmp, 'x'), '5=' + os.path.join(tmp, 'x')]:
+        run(binary, ['--extract=' + spec, disk], code=147)
+
+    # File table pointing outside of container must not make anything else be extracted
+    for lba, size in [(1 << 55, 4), (8, 1 << 55), (100, 4), (8, (1 << 64) - 1)]:
+        fixtures.write(os.path.join(tmp, 'outside.disk'), bytes(fixtures.bcd_image([(lba, size, 0, b'')], 24, 24, [(8 * fixtures.BLOCK, image[8 * fixtures.BLOCK:])])))
+        out = run(binary, ['--extract=lintel=' + os.path.join(tmp, 'outside'), os.path.join(tmp, 'outside.disk')], code=148)
+        check('outside of' in out or 'truncated' in out, 'Wrong error for lintel of %d blocks at block %d:\n%s', size, lba, out)
+
+
+def case_bcd_scan(binary, tmp):
+    args, kexec, removes = fixtures.make_tree(tmp)
+    bcd_path = os.path.join(tmp, 'bcd')
+    lintel = fixtures.make_bcd(bcd_path)
+    bcd = read_bytes(bcd_path)
+    mib = 1 << 20
+
+    def boot(name, disk, found, extra=[], stdin=None):
+        path = os.path.join(tmp, name + '.disk')
+        fixtures.write(path, bytes(disk))
+        fixtures.write(kexec)
+        if stdin:
+            with open(path, 'rb') as f:
+                out = run(binary, args + ['-X', '-b', '--scan'] + extra + ['-'], stdin=f)
+        else:
+            out = run(binary, args + ['-X', '-b', '--scan'] + extra + [path])
+        check(found in out, 'Expected \'%s\' for %s:\n%s', found, name, out)
+        name_, h, rest = payload(kexec)
+        check(name_ == 'LINTEL_REBOOT' and rest.startswith(lintel), 'Lintel from %s is not booted:\n%s', name, out)
+
+    boot('mbr', fixtures.disk_image(bcd, 'mbr', mib, 2 * mib, 3), 'Found BCD container in partition 3 at offset %d.' % mib)
+    boot('gpt', fixtures.disk_image(bcd, 'gpt', mib, 2 * mib, 2), 'Found BCD container in partition 2 at offset %d.' % mib)
+    boot('gpt4k', fixtures.disk_image(bcd, 'gpt', mib, 2 * mib, 5, 4096), 'Found BCD container in partition 5 at offset %d.' % mib)
+    boot('raw', fixtures.disk_image(bcd, 'none', 3 * mib + 512, 4 * mib), 'Found BCD container at offset %d' % (3 * mib + 512))
+    boot('stdin', fixtures.disk_image(bcd, 'gpt', mib, 2 * mib, 2), 'Found BCD container in partition 2 at offset %d.' % mib, stdin=True)
+
+    # Signatures without a table that fits, and partition tables pointing nowhere, are passed over
+    disk = fixtures.disk_image(bcd, 'none', 3 * mib, 4 * mib)
+    decoy = struct.pack('<QIQ', fixtures.BCD_SIGNATURE, 0, 0)
+    disk[mib + 512:mib + 512 + len(decoy)] = decoy
+    decoy = struct.pack('<QIQ', fixtures.BCD_SIGNATURE, 3, 1 << 40)
+    disk[2 * mib + 512:2 * mib + 512 + len(decoy)] = decoy
+    boot('decoys', disk, 'Found BCD container at offset %d' % (3 * mib))
+    disk = fixtures.disk_image(bcd, 'gpt', 3 * mib, 4 * mib, 1)
+    struct.pack_into('<QQ', disk, 1024 + 32, 1 << 60, (1 << 60) + 15)
+    boot('gpt_outside', disk, 'Found BCD container at offset %d' % (3 * mib))
+    disk = fixtures.disk_image(bcd, 'gpt', 3 * mib, 4 * mib, 1)
+    struct.pack_into('<QII', disk, 512 + 72, 1 << 60, 1 << 31, 1 << 31)
+    boot('gpt_table_outside', disk, 'Found BCD container at offset %d' % (3 * mib))
+    disk = fixtures.disk_image(bcd, 'mbr', 3 * mib, 4 * mib, 1)
+    struct.pack_into('<I', disk, 446 + 8, 0xffffffff)
+    boot('mbr_outside', disk, 'Found BCD container at offset %d' % (3 * mib))
+
+    # Scan is split into 64 MiB chunks scanned in parallel: the lowest valid container is taken whichever chunk it is in
+    disk = fixtures.disk_image(bcd, 'none', 100 * mib, 200 * mib)
+    disk[150 * mib:150 * mib + len(bcd)] = bcd
+    for off in range(mib, 100 * mib, 7 * mib):
+        decoy = struct.pack('<QIQ', fixtures.BCD_SIGNATURE, 1, 1 << 40)
+        disk[off + 512:off + 512 + len(decoy)] = decoy
+    boot('chunks', disk, 'Found BCD container at offset %d' % (100 * mib))
+
+    # Nothing found: file is taken for a raw lintel starter
+    path = os.path.join(tmp, 'nothing.disk')
+    fixtures.make_blob(path, 2 * mib, 3)
+    fixtures.write(kexec)
+    out = run(binary, args + ['-X', '-b', '-l', '--scan', path])
+    check('No BCD container found in file' in out and payload(kexec)[1]['image_size'] == 2 * mib, 'File without BCD container is not loaded as is:\n%s', out)
+
+
+def case_mountinfo(binary, tmp):
+    args, kexec, removes = fixtures.make_tree(tmp)
+    fixtures.make_blob(os.path.join(tmp, 'vmlinux'), 4096, 1)
+    # Remount writes nothing but these, and only when filesystems are not remounted one by one
+    fixtures.write(os.path.join(tmp, 'proc/sys/kernel/printk'))
+    fixtures.write(os.path.join(tmp, 'proc/sysrq-trigger'))
+    root = os.path.join(tmp, 'mnt')
+    spaced = os.path.join(root, 'home/with space')
+    odd = os.path.join(spaced, 'back\\slash\ttab')
+    for d in [root, os.path.join(root, 'home'), spaced, odd, os.path.join(tmp, 'orphan')]:
+        os.makedirs(d, exist_ok=True)
+    esc = lambda p: p.replace('\\', '\\134').replace(' ', '\\040').replace('\t', '\\011')
+    table = [
+        # id, parent, device, path, options, optional fields, fstype; writable ones not virtual and not seen before are done
+        (21, 1, '8:1', root, 'rw,relatime', 'shared:1', 'ext4'),
+        (22, 21, '0:5', root + '/dev', 'rw,nosuid', 'shared:2', 'devtmpfs'),
+        (23, 21, '8:2', root + '/home', 'rw,nodev,relatime', 'shared:3 master:1', 'xfs'),
+        (24, 23, '8:3', spaced, 'rw', '', 'ext4'),
+        (25, 21, '8:4', root + '/boot', 'ro,relatime', '', 'vfat'),
+        (26, 21, '8:1', root + '/var', 'rw', '', 'ext4'),
+        (27, 24, '0:40', spaced + '/tmp', 'rw', '', 'tmpfs'),
+        (28, 24, '8:5', odd, 'rw,noatime', '', 'btrfs'),
+        (29, 99, '8:6', os.path.join(tmp, 'orphan'), 'rw', '', 'ext4'),
+        (30, 21, '8:7', root + '/rwx', 'rwx', '', 'ext4'),
+    ]
+    lines = ['%d %d %s / %s %s %s- %s /dev/x rw\n' % (i, p, d, esc(path), o, opt + ' ' if opt else '', t) for i, p, d, path, o, opt, t in table]
+    fixtures.write(os.path.join(tmp, 'proc/self/mountinfo'), ''.join(lines))
+    done = [odd, spaced, root + '/home', root, os.path.join(tmp, 'orphan')]
+
+    report = os.path.join(tmp, 'report.json')
+    out = run(binary, args + ['-X', '-b', '-x', '--remount=targeted', '--report=' + report, '-c', 'quiet', os.path.join(tmp, 'vmlinux')], safe=['-M', '-r'])
+    check('Mount table is not of this system' in out, 'Filesystems of fixture mount table are remounted for real:\n%s', out)
+    order = re.findall(r'^Would remount (.*) \((\w+)\) read-only\.$', out, re.M)
+    check(sorted(p for p, t in order) == sorted(done), 'Wrong filesystems are remounted: %s', order)
+    for child, parent in [(odd, spaced), (spaced, root + '/home'), (root + '/home', root)]:
+        check([p for p, t in order].index(child) < [p for p, t in order].index(parent), '%s is remounted before %s mounted on it', parent, child)
+    with open(report) as f:
+        flushed = json.load(f)['mounts']
+    check(sorted((m['path'], m['fstype']) for m in flushed) == sorted(order), 'Filesystems flushed differ from ones remounted: %s', flushed)
+    check(all('error' not in m for m in flushed), 'Filesystems are not flushed: %s', flushed)
+
+    # Malformed tables are refused before anything is done
+    for bad in ['21 1 8:1 / /mnt rw shared:1 ext4 /dev/x rw\n', '21 1 8:1\n', '21 x 8:1 / /mnt rw - ext4 /dev/x rw\n', '21 1 8:1 / /mnt rw shared:1 -\n']:
+        fixtures.write(os.path.join(tmp, 'proc/self/mountinfo'), ''.join(lines[:3]) + bad)
+        out = run(binary, args + ['-X', '-b', '-x', '--remount=targeted', '-c', 'quiet', os.path.join(tmp, 'vmlinux')], code=137, safe=['-M', '-r'])
+        check('Can\'t parse' in out, 'Malformed mount table line %r is not reported:\n%s', bad, out)
+
+
+def case_elf_strip(binary, tmp):
+    args, kexec, removes = fixtures.make_tree(tmp)
+    path = os.path.join(tmp, 'vmlinux')
+    PT_LOAD, PT_NOTE = 1, 4
+    segments = [(PT_LOAD, 0x1000, 0x3000, 0x3000, 0x10000), (PT_NOTE, 0x1100, 0x40, 0x40, 0x10100), (PT_LOAD, 0x5000, 0x800, 0x2000, 0x20000),
+                (PT_LOAD, 0, 0, 0x1000, 0x30000), (PT_NOTE, 0x9000, 0x100, 0x100, 0)]
+    elf = fixtures.elf_image(segments, 0x20000, 4)
+
+    def boot(data, compress=None):
+        fixtures.write(path, bytes(data))
+        name = compress_file(path, compress) if compress else path
+        out = run(binary, args + ['-X', '-b', '--strip-elf', '-c', 'quiet', name])
+        if compress: os.unlink(name)
+        kind, h, rest = payload(kexec)
+        return out, rest[h['cmdline_size']:]
+
+    # Compressed kernel is decompressed as it is read, and stripped all the same
+    for compress in [None] + FORMATS:
+        out, image = boot(elf, compress)
+        check('Loaded stripped ELF kernel: %d of %d bytes' % (0x5000, len(elf)) in out, 'ELF kernel is not stripped to its loadable segments:\n%s', out)
+        phnum, = struct.unpack_from('<H', image, 56)
+        shoff, = struct.unpack_from('<Q', image, 40)
+        shnum, = struct.unpack_from('<H', image, 60)
+        check(image[:40] == elf[:40] and shoff == 0 and shnum == 0, 'ELF header is not kept, or section headers are')
+        kept = [struct.unpack_from('<IIQQQQQQ', image, 64 + 56 * n) for n in range(phnum)]
+        check([(p[0], p[3]) for p in kept] == [(PT_LOAD, 0x10000), (PT_NOTE, 0x10100), (PT_LOAD, 0x20000), (PT_LOAD, 0x30000)], 'Wrong program headers are kept: %s', kept)
+        for ptype, flags, offset, vaddr, paddr, filesz, memsz, align in kept:
+            orig = next(s for s in segments if s[4] == vaddr)
+            check(filesz == orig[2] and memsz == orig[3] and image[offset:offset + filesz] == elf[orig[1]:orig[1] + filesz], 'Segment at 0x%x is not moved along with its data', vaddr)
+
+    # Other program headers pointing outside of what is kept, even by wrapping around, are dropped
+    for offset, filesz in [(0x1e000, 0x100), ((1 << 64) - 0x100, 0x1100), ((1 << 64) - 1, 1)]:
+        out, image = boot(fixtures.elf_image(segments + [(PT_NOTE, offset, filesz, filesz, 0x40000)], 0x20000, 4))
+        phnum, = struct.unpack_from('<H', image, 56)
+        kept = [struct.unpack_from('<IIQQQQQQ', image, 64 + 56 * n) for n in range(phnum)]
+        check([p[3] for p in kept] == [0x10000, 0x10100, 0x20000, 0x30000], 'Note of 0x%x bytes at 0x%x is kept: %s', filesz, offset, kept)
+
+    # Anything not understood is loaded as is
+    bad = {
+        'not an ELF file': [b'\x7fELG' + bytes(elf[4:]), b'ELF\x7f' + bytes(elf[4:])],
+        'not a native 64-bit ELF file': [fixtures.elf_image(segments, 0x20000, 4, ident=b'\x7fELF\x01\x01\x01'), fixtures.elf_image(segments, 0x20000, 4, ident=b'\x7fELF\x02\x02\x01')],
+        'malformed program header table': [fixtures.elf_image(segments, 0x20000, 4, phoff=0x1ff00), fixtures.elf_image(segments, 0x20000, 4, phoff=65),
+                                           fixtures.elf_image(segments, 0x20000, 4, phoff=1 << 63), fixtures.elf_image([], 0x20000, 4)],
+        'loadable segment beyond end of file': [fixtures.elf_image([(PT_LOAD, 0x1000, 0x20000, 0x20000, 0)], 0x20000, 4), fixtures.elf_image([(PT_LOAD, 0x21000, 0x10, 0x10, 0)], 0x20000, 4),
+                                                fixtures.elf_image([(PT_LOAD, 0x1000, (1 << 64) - 0x800, 0, 0)], 0x20000, 4)],
+        'no loadable segments': [fixtures.elf_image([(PT_NOTE, 0x1000, 0x10, 0x10, 0)], 0x20000, 4)],
+    }
+    for why, images in bad.items():
+        for data in images:
+            out, image = boot(data)
+            check('Kernel image is loaded as is: %s.' % why in out, 'Expected \'%s\':\n%s', why, out)
+            check(image == data, 'Kernel image that is %s is not loaded as is', why)
+
+
+TESTS = {
+    'kernel_payload': case_kernel_payload,
+    'kernel_cmdline': case_kernel_cmdline,
+    'lintel_payload': case_lintel_payload,
+    'fb_reset': case_fb_reset,
+    'display_server': case_display_server,
+    'no_processes': case_no_processes,
+    'relocated_roots': case_relocated_roots,
+    'cache_header': case_cache_header,
+    'bcd_inspect': case_bcd_inspect,
+    'bcd_scan': case_bcd_scan,
+    'mountinfo': case_mountinfo,
+    'elf_strip': case_elf_strip,
+}
+
+# name: (fixture sizes, extra arguments, phases to report, whether the run writes to the tree)
+BENCHMARKS = {
+    'many_vtcons': ({'vtcons': 10000}, ['-X', '-x'], ['reset_fbdriver.vtunbind'], True),
+    'deep_pci': ({'depth': 9, 'fanout': 3}, ['-X', '-x'], ['reset_fbdriver.rmpci'], True),
+    'many_fbs': ({'fbs': 5000}, ['-X', '-x'], ['reset_fbdriver.detect'], True),
+    'proc_scan': ({'pids': 50000}, ['-b', '-x'], ['check_xorg'], False),
+}
+BENCH_RUNS = 5
+
+
+def bench(binary, name, tmp):
+    sizes, extra, phases, writes = BENCHMARKS[name]
+    print('Generating fixtures %s...' % ', '.join('%s=%d' % i for i in sizes.items()))
+    start = time.monotonic()
+    fixtures.make_blob(os.path.join(tmp, 'vmlinux'), 4096, 1)
+    times = {p: [] for p in phases}
+    for i in range(BENCH_RUNS):
+        # PCI removal and console unbinding are written to the tree, so such runs get a fresh one each
+        if i == 0 or writes:
+            args, kexec, removes = fixtures.make_tree(os.path.join(tmp, str(i)), **sizes)
+        if i == 0: print('Generated in %.1f s.' % (time.monotonic() - start))
+        report = os.path.join(tmp, 'report.json')
+        run(binary, args + extra + ['-c', 'quiet', '--report=' + report, os.path.join(tmp, 'vmlinux')])
+        with open(report) as f:
+            ms = {p['name']: p['ms'] for p in json.load(f)['phases']}
+        for p in phases:
+            check(p in ms, 'Phase %s is not reported', p)
+            times[p].append(ms[p])
+    for p in phases:
+        print('%s: min %.3f ms, median %.3f ms, max %.3f ms over %d runs' % (p, min(times[p]), statistics.median(times[p]), max(times[p]), BENCH_RUNS))
+
+
+def main():
+    argv = sys.argv[1:]
+    if argv == ['--list']:
+        print('tests: ' + ' '.join(TESTS))
+        print('benchmarks: ' + ' '.join(BENCHMARKS))
+        return 0
+    is_bench = bool(argv) and argv[0] == '--bench'
+    if is_bench: argv = argv[1:]
+    if len(argv) != 2 or argv[1] not in (BENCHMARKS if is_bench else TESTS):
+        print('Usage: %s [--bench] KEXEC_E2K CASE, or %s --list' % (sys.argv[0], sys.argv[0]), file=sys.stderr)
+        return 2
+    binary, name = os.path.abspath(argv[0]), argv[1]
+    with tempfile.TemporaryDirectory(prefix='kexec-e2k-' + name + '-') as tmp:
+        try:
+            if is_bench: bench(binary, name, tmp)
+            else: TESTS[name](binary, tmp)
+        except (Failure, subprocess.TimeoutExpired) as e:
+            print('FAIL: %s' % e)
+            return 1
+    print('PASS' if not is_bench else 'DONE')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
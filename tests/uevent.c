@@ -0,0 +1,67 @@
+/* Feeds kernel uevent parsing of PCI device removal with messages as kernel sends them, and with malformed ones */
+#define main kexec_main
+#include "kexec-e2k.c"
+#undef main
+
+static int failed = 0;
+
+#define EXPECT(cond, ...) do { if (!(cond)) { printf("FAIL: " __VA_ARGS__); printf("\n"); failed = 1; } } while (0)
+
+static const char *parse(const char *msg, size_t n)
+{
+    /* Message is copied to a buffer with garbage after it, as if received into a reused one */
+    static char buf[8192];
+    memset(buf, 'x', sizeof(buf));
+    memcpy(buf, msg, n);
+    return uevent_removed(buf, n);
+}
+
+#define PARSE(msg) parse(msg, sizeof(msg) - 1)
+#define REMOVE "remove@/devices/pci0000:00/0000:00:01.0/0000:01:00.0\0ACTION=remove\0"
+#define DEVPATH "DEVPATH=/devices/pci0000:00/0000:00:01.0/0000:01:00.0\0"
+
+int main()
+{
+    const char *id;
+
+    id = PARSE(REMOVE DEVPATH "SUBSYSTEM=pci\0SEQNUM=1234\0");
+    EXPECT(id && !strcmp(id, "0000:01:00.0"), "removal is not recognized");
+    id = PARSE("SEQNUM=1\0SUBSYSTEM=pci\0" DEVPATH "ACTION=remove\0");
+    EXPECT(id && !strcmp(id, "0000:01:00.0"), "removal with keys in other order is not recognized");
+    id = PARSE(REMOVE DEVPATH "SUBSYSTEM=pci");
+    EXPECT(id && !strcmp(id, "0000:01:00.0"), "removal without trailing zero is not recognized");
+    id = PARSE("ACTION=remove\0DEVPATH=0000:02:00.0\0SUBSYSTEM=pci\0");
+    EXPECT(id && !strcmp(id, "0000:02:00.0"), "device path without slashes is not taken as id");
+
+    EXPECT(PARSE("add@/devices/pci0000:00/0000:01:00.0\0ACTION=add\0" DEVPATH "SUBSYSTEM=pci\0") == NULL, "addition is taken for removal");
+    EXPECT(PARSE(REMOVE DEVPATH "SUBSYSTEM=pci_bus\0") == NULL, "removal of PCI bus is taken for removal of device");
+    EXPECT(PARSE(REMOVE DEVPATH "SUBSYSTEM=pcie\0") == NULL, "subsystem is matched by prefix");
+    EXPECT(PARSE("ACTION=removed\0" DEVPATH "SUBSYSTEM=pci\0") == NULL, "action is matched by prefix");
+    EXPECT(PARSE(REMOVE "SUBSYSTEM=pci\0") == NULL, "removal without device path is accepted");
+    EXPECT(PARSE(DEVPATH "SUBSYSTEM=pci\0") == NULL, "message without action is accepted");
+    EXPECT(PARSE(REMOVE DEVPATH) == NULL, "message without subsystem is accepted");
+    EXPECT(PARSE(REMOVE DEVPATH "XSUBSYSTEM=pci\0") == NULL, "key is matched in the middle of a string");
+    EXPECT(PARSE("") == NULL, "empty message is accepted");
+    EXPECT(parse(REMOVE DEVPATH "SUBSYSTEM=pci\0", sizeof(REMOVE DEVPATH) - 1 + 7) == NULL, "subsystem cut short is accepted");
+
+    /* Only devices of level being removed, not failed and not confirmed yet, are matched by the last component of their path */
+    struct pcidev_t devs[] =
+    {
+        { "0000:00:01.0/0000:01:00.0", 0 },
+        { "0000:00:01.0/0000:01:00.1", 0 },
+        { "0000:00:01.0/0000:01:00.0/0000:02:00.0", 1 },
+        { "0000:00:01.0/0000:01:00.0/0000:02:00.0/0000:03:00.0", 2 },
+        { "0000:00:01.0/0000:01:00.0/0000:02:00.0/0000:03:00.1", 2, EIO },
+    };
+    struct pcitree_t t = { devs, sizeof(devs) / sizeof(devs[0]), sizeof(devs) / sizeof(devs[0]), 2 };
+    EXPECT(uevent_match(&t, "0000:03:00.0") == 1 && devs[3].confirmed, "device of current level is not confirmed");
+    EXPECT(uevent_match(&t, "0000:03:00.0") == 0, "device is confirmed twice");
+    EXPECT(uevent_match(&t, "0000:03:00.1") == 0 && !devs[4].confirmed, "device that failed to be removed is confirmed");
+    EXPECT(uevent_match(&t, "0000:02:00.0") == 0 && !devs[2].confirmed, "device of other level is confirmed");
+    EXPECT(uevent_match(&t, "03:00.0") == 0 && uevent_match(&t, "") == 0, "device is matched by part of its id");
+    t.level = 0;
+    EXPECT(uevent_match(&t, "0000:01:00.1") == 1 && devs[1].confirmed && !devs[0].confirmed, "device of top level is not confirmed");
+
+    if (!failed) printf("PASS\n");
+    return failed;
+}